@@ -0,0 +1,191 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "alert.h"
+#include "notify.h"
+#include "upower.h"
+
+static const enum urgency state_urgency[UPOWER_DEVICE_STATE_LAST] = {
+	[UPOWER_DEVICE_STATE_UNKNOWN] = URGENCY_NORMAL,
+	[UPOWER_DEVICE_STATE_CHARGING] = URGENCY_NORMAL,
+	[UPOWER_DEVICE_STATE_DISCHARGING] = URGENCY_NORMAL,
+	[UPOWER_DEVICE_STATE_EMPTY] = URGENCY_CRITICAL,
+	[UPOWER_DEVICE_STATE_FULLY_CHARGED] = URGENCY_NORMAL,
+	[UPOWER_DEVICE_STATE_PENDING_CHARGE] = URGENCY_NORMAL,
+	[UPOWER_DEVICE_STATE_PENDING_DISCHARGE] = URGENCY_NORMAL,
+};
+
+static const struct alert_action warning_unknown = {
+	ALERT_WARNING, URGENCY_CRITICAL, "power.unknown", "Warning: unknown warning level\n",
+};
+
+static const struct alert_action warning_actions[UPOWER_DEVICE_LEVEL_LAST] = {
+	[UPOWER_DEVICE_LEVEL_UNKNOWN] = { ALERT_WARNING, URGENCY_CRITICAL, "power.unknown", "Warning: unknown warning level\n" },
+	[UPOWER_DEVICE_LEVEL_NONE] = { ALERT_WARNING, URGENCY_NORMAL, "power.cleared", "Warning cleared\n" },
+	[UPOWER_DEVICE_LEVEL_DISCHARGING] = { ALERT_WARNING, URGENCY_CRITICAL, "power.discharging", "Warning: system discharging\n" },
+	[UPOWER_DEVICE_LEVEL_LOW] = { ALERT_WARNING, URGENCY_CRITICAL, "power.low", "Warning: power level low\n" },
+	[UPOWER_DEVICE_LEVEL_CRITICAL] = { ALERT_WARNING, URGENCY_CRITICAL, "power.critical", "Warning: power level critical\n" },
+	[UPOWER_DEVICE_LEVEL_ACTION] = { ALERT_WARNING, URGENCY_CRITICAL, "power.action", "Warning: power level at action threshold\n" },
+	[UPOWER_DEVICE_LEVEL_NORMAL] = { ALERT_WARNING, URGENCY_CRITICAL, "power.unknown", "Warning: unknown warning level\n" },
+	[UPOWER_DEVICE_LEVEL_HIGH] = { ALERT_WARNING, URGENCY_CRITICAL, "power.unknown", "Warning: unknown warning level\n" },
+	[UPOWER_DEVICE_LEVEL_FULL] = { ALERT_WARNING, URGENCY_CRITICAL, "power.unknown", "Warning: unknown warning level\n" },
+};
+
+static const struct alert_action online_actions[2] = {
+	{ ALERT_ONLINE, URGENCY_NORMAL, "power.offline", "Power supply offline" },
+	{ ALERT_ONLINE, URGENCY_NORMAL, "power.online", "Power supply online" },
+};
+
+static const struct alert_action hot_action = {
+	ALERT_HEALTH, URGENCY_CRITICAL, "power.hot", "Warning: battery overheating\n",
+};
+
+static const struct alert_action worn_action = {
+	ALERT_HEALTH, URGENCY_NORMAL, "power.worn", "Warning: battery capacity degraded\n",
+};
+
+static const struct alert_action removed_action = {
+	ALERT_REMOVED, URGENCY_NORMAL, "device.removed", "Device disconnected\n",
+};
+
+static enum urgency state_urgency_of(enum upower_device_state state) {
+	return state >= 0 && state < UPOWER_DEVICE_STATE_LAST ? state_urgency[state] : URGENCY_NORMAL;
+}
+
+static const struct alert_action *warning_action(enum upower_device_level level) {
+	return level >= 0 && level < UPOWER_DEVICE_LEVEL_LAST ? &warning_actions[level] : &warning_unknown;
+}
+
+int alert_evaluate(const struct upower_device_props *last, const struct upower_device_props *current,
+		bool has_battery, struct alert_action *actions) {
+	int count = 0;
+
+	if (!has_battery) {
+		if (current->online != last->online) {
+			actions[count++] = *alert_online(current->online);
+		}
+		return count;
+	}
+
+	// Transitions to/from unknown are silenced
+	if (current->state != last->state && current->state != UPOWER_DEVICE_STATE_UNKNOWN) {
+		actions[count++] = (struct alert_action){
+			.kind = ALERT_STATE,
+			.urgency = state_urgency_of(current->state),
+			.category = "power.update",
+			.message = NULL,
+		};
+	}
+
+	if (current->warning_level != last->warning_level &&
+			!(current->warning_level == UPOWER_DEVICE_LEVEL_NONE && last->warning_level == UPOWER_DEVICE_LEVEL_UNKNOWN)) {
+		actions[count++] = *warning_action(current->warning_level);
+	}
+
+	return count;
+}
+
+int alert_evaluate_health(const struct upower_device_props *last, const struct upower_device_props *current,
+		int hot, int worn, struct alert_action *actions) {
+	int count = 0;
+
+	if (hot > 0 && current->temperature >= hot && last->temperature < hot) {
+		actions[count++] = hot_action;
+	}
+
+	// A capacity of 0 is not known yet
+	if (worn > 0 && current->capacity > 0 && current->capacity < worn &&
+			(last->capacity == 0 || last->capacity >= worn)) {
+		actions[count++] = worn_action;
+	}
+
+	return count;
+}
+
+bool alert_refresh(const struct alert_action *held, const struct upower_device_props *current,
+		int worn, struct alert_action *action) {
+	*action = *held;
+	switch (held->kind) {
+	case ALERT_STATE:
+		// Rendered from the current state when sent
+		action->urgency = state_urgency_of(current->state);
+		break;
+	case ALERT_WARNING:
+		*action = *warning_action(current->warning_level);
+		break;
+	case ALERT_ONLINE:
+		*action = *alert_online(current->online);
+		break;
+	case ALERT_HEALTH:
+		if (strcmp(held->category, worn_action.category) == 0 &&
+				!(worn > 0 && current->capacity > 0 && current->capacity < worn)) {
+			return false;
+		}
+		break;
+	case ALERT_REMOVED:
+		break;
+	}
+
+	// Critical alerts are never held back, so one for where the device is
+	// now already went out when it got there
+	return action->urgency != URGENCY_CRITICAL;
+}
+
+double alert_next_temperature(double last, double current, int hot) {
+	if (hot > 0 && last >= hot && current < hot && current > hot - ALERT_HOT_HYSTERESIS) {
+		return last;
+	}
+	return current;
+}
+
+struct upower_device_props alert_next_last(const struct upower_device_props *last,
+		const struct upower_device_props *current) {
+	struct upower_device_props next = *current;
+	if (current->state == UPOWER_DEVICE_STATE_UNKNOWN) {
+		// Keep comparing against the last known state
+		next.state = last->state;
+	}
+	return next;
+}
+
+struct upower_device_props alert_apply_thresholds(const struct upower_device_props *current,
+		int low, int critical) {
+	struct upower_device_props effective = *current;
+	if (current->state != UPOWER_DEVICE_STATE_DISCHARGING) {
+		return effective;
+	}
+
+	enum upower_device_level level = UPOWER_DEVICE_LEVEL_UNKNOWN;
+	if (critical > 0 && current->percentage <= critical) {
+		level = UPOWER_DEVICE_LEVEL_CRITICAL;
+	} else if (low > 0 && current->percentage <= low) {
+		level = UPOWER_DEVICE_LEVEL_LOW;
+	}
+
+	// Thresholds only ever raise the level UPower reports
+	switch (current->warning_level) {
+	case UPOWER_DEVICE_LEVEL_UNKNOWN:
+	case UPOWER_DEVICE_LEVEL_NONE:
+	case UPOWER_DEVICE_LEVEL_DISCHARGING:
+		break;
+	case UPOWER_DEVICE_LEVEL_LOW:
+		if (level != UPOWER_DEVICE_LEVEL_CRITICAL) {
+			return effective;
+		}
+		break;
+	default:
+		return effective;
+	}
+	if (level != UPOWER_DEVICE_LEVEL_UNKNOWN) {
+		effective.warning_level = level;
+	}
+	return effective;
+}
+
+const struct alert_action *alert_removed(void) {
+	return &removed_action;
+}
+
+const struct alert_action *alert_online(bool online) {
+	return &online_actions[online ? 1 : 0];
+}
@@ -0,0 +1,70 @@
+#ifndef _ALERT_H
+#define _ALERT_H
+
+#include <stdbool.h>
+
+#include "notify.h"
+#include "upower.h"
+
+// The most actions a single device transition can produce
+#define ALERT_MAX_ACTIONS 2
+
+// How far in °C an overheated battery must cool down before it can raise
+// another alert
+#define ALERT_HOT_HYSTERESIS 3
+
+enum alert_kind {
+	ALERT_STATE,
+	ALERT_WARNING,
+	ALERT_ONLINE,
+	ALERT_REMOVED,
+	ALERT_HEALTH,
+};
+
+// A notification decided upon by the alert engine. Messages are static
+// strings, except for state updates where the caller renders the current
+// state and level.
+struct alert_action {
+	enum alert_kind kind;
+	enum urgency urgency;
+	const char *category;
+	const char *message;
+};
+
+// Decides which alerts a transition from last to current warrants. Pure,
+// neither allocates nor performs I/O. Returns the number of actions
+// written, at most ALERT_MAX_ACTIONS.
+int alert_evaluate(const struct upower_device_props *last, const struct upower_device_props *current,
+		bool has_battery, struct alert_action *actions);
+
+// Returns the props to compare the next transition against.
+struct upower_device_props alert_next_last(const struct upower_device_props *last,
+		const struct upower_device_props *current);
+
+// Returns current with the warning level raised to low or critical if the
+// percentage of a discharging device is at or below the given thresholds.
+// Thresholds of 0 are unset.
+struct upower_device_props alert_apply_thresholds(const struct upower_device_props *current,
+		int low, int critical);
+
+// Decides which alerts the battery health warrants, given the thresholds
+// of the device policy: a temperature reaching hot, or a capacity falling
+// below worn. Thresholds of 0 are unset. Like alert_evaluate(), pure.
+int alert_evaluate_health(const struct upower_device_props *last, const struct upower_device_props *current,
+		int hot, int worn, struct alert_action *actions);
+
+// Rebuilds an alert the rate limiter held back from the props a device has
+// by now, as the latest alert held back may no longer match them. Returns
+// false if they no longer warrant an alert.
+bool alert_refresh(const struct alert_action *held, const struct upower_device_props *current,
+		int worn, struct alert_action *action);
+
+// Returns the temperature to compare the next transition against, which
+// stays at or above hot until the battery has cooled down by
+// ALERT_HOT_HYSTERESIS, so that one hovering around hot alerts only once.
+double alert_next_temperature(double last, double current, int hot);
+
+const struct alert_action *alert_removed(void);
+const struct alert_action *alert_online(bool online);
+
+#endif
@@ -0,0 +1,405 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alert.h"
+#include "dbus.h"
+#include "idmap.h"
+#include "list.h"
+#include "message.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "record.h"
+#include "snapshot.h"
+#include "upower.h"
+
+// Measures decoding, alert evaluation and dispatch throughput over a
+// recording made with poweralertd -r. Every recorded event is turned back
+// into the signal it was decoded from, so the decoders see the same
+// payloads as in production.
+
+struct bench_event {
+	uint64_t timestamp_ms;
+	enum record_event_type type;
+	enum upower_device_type device_type;
+	int power_supply;
+	sd_bus_message *msg;
+};
+
+// The benchmark is linked with --wrap for the allocator entry points, so
+// that heap traffic during a pass can be reported next to its throughput.
+static size_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s) {
+	allocations++;
+	return __real_strdup(s);
+}
+
+static uint64_t now_us(void) {
+	struct timespec current;
+	clock_gettime(CLOCK_MONOTONIC, &current);
+	return (uint64_t)current.tv_sec * 1000000 + current.tv_nsec / 1000;
+}
+
+static int load(sd_bus *bus, const char *path, struct bench_event **events, size_t *len) {
+	struct replayer replayer = { 0 };
+	struct record_event event;
+	size_t cap = 0;
+	int ret;
+
+	ret = replayer_open(&replayer, path);
+	if (ret < 0) {
+		return ret;
+	}
+
+	*len = 0;
+	while ((ret = replayer_read(&replayer, &event)) > 0) {
+		if (*len == cap) {
+			cap = cap ? cap * 2 : 1024;
+			struct bench_event *resized = realloc(*events, cap * sizeof(struct bench_event));
+			if (resized == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			*events = resized;
+		}
+		struct bench_event *e = &(*events)[*len];
+		e->timestamp_ms = event.timestamp_us / 1000;
+		e->type = event.type;
+		e->device_type = event.device_type;
+		e->power_supply = event.power_supply;
+		switch (event.type) {
+		case RECORD_DEVICE_ADDED:
+			ret = message_device_signal(bus, &e->msg, "DeviceAdded", event.path);
+			break;
+		case RECORD_DEVICE_REMOVED:
+			ret = message_device_signal(bus, &e->msg, "DeviceRemoved", event.path);
+			break;
+		case RECORD_DEVICE_CHANGED:
+			ret = message_properties_changed(bus, &e->msg, event.path, event.mask, &event.props);
+			break;
+		}
+		if (ret < 0) {
+			break;
+		}
+		(*len)++;
+	}
+
+	replayer_close(&replayer);
+	return ret;
+}
+
+static struct upower_device *find_device(struct upower *state, const char *path) {
+	for (int idx = 0; idx < state->devices->length; idx++) {
+		struct upower_device *device = state->devices->items[idx];
+		if (strcmp(device->path, path) == 0) {
+			return device;
+		}
+	}
+	return NULL;
+}
+
+// What alerts go through on their way to a notification: the rate
+// limiter, the queue, and the map of the IDs they are shown under
+struct bench_dispatch {
+	struct rate_limiter limiter;
+	struct alert_queue queue;
+	struct id_map ids;
+	uint32_t next_id;
+};
+
+static void dispatch_alert(struct bench_dispatch *dispatch, struct upower_device *device,
+		const struct alert_action *action, uint64_t now) {
+	// The default limit
+	if (rate_limit_take(&dispatch->limiter, device, action, 5, 60000, now)) {
+		alert_queue_push(&dispatch->queue, device, action, 0);
+	}
+}
+
+// Sends whatever is queued, as notifications replacing those already shown
+// in the same slot, with the IDs a notification daemon would give them.
+static void dispatch_flush(struct bench_dispatch *dispatch, uint64_t now) {
+	struct upower_device *device;
+	struct alert_action action;
+	uint32_t suppressed;
+	while (rate_limit_release(&dispatch->limiter, now, &device, &action, &suppressed)) {
+		alert_queue_push(&dispatch->queue, device, &action, suppressed);
+	}
+
+	struct queued_alert alert;
+	while (alert_queue_pop(&dispatch->queue, &alert)) {
+		int slot;
+		switch (alert.action.kind) {
+		case ALERT_STATE:
+			slot = SLOT_STATE;
+			break;
+		case ALERT_WARNING:
+			slot = SLOT_WARNING;
+			break;
+		case ALERT_ONLINE:
+			slot = SLOT_ONLINE;
+			break;
+		default:
+			continue;
+		}
+		uint32_t *id = &alert.device->notifications[slot];
+		uint32_t previous = *id;
+		if (*id == 0) {
+			*id = ++dispatch->next_id;
+		}
+		id_map_update(&dispatch->ids, id, previous);
+	}
+}
+
+static void dispatch_forget_device(struct bench_dispatch *dispatch, struct upower_device *device) {
+	alert_queue_forget_device(&dispatch->queue, device);
+	rate_limit_forget_device(&dispatch->limiter, device);
+	for (int slot = 0; slot < 3; slot++) {
+		id_map_take(&dispatch->ids, device->notifications[slot]);
+	}
+}
+
+// Runs the recording through the decoders, and through alert evaluation
+// if evaluate is set, and then through dispatch if given. Returns the
+// number of alerts decided upon.
+static int run_state(struct upower *state, struct bench_event *events, size_t len, bool evaluate,
+		struct bench_dispatch *dispatch) {
+	struct alert_action actions[ALERT_MAX_ACTIONS];
+	int alerts = 0;
+
+	for (size_t idx = 0; idx < len; idx++) {
+		struct bench_event *e = &events[idx];
+		struct upower_device *device = NULL;
+		struct upower_device_props props = { 0 };
+		const char *path;
+		uint32_t mask = 0;
+
+		sd_bus_message_rewind(e->msg, 1);
+		switch (e->type) {
+		case RECORD_DEVICE_ADDED:
+			if (upower_decode_device_path(e->msg, &path) > 0 && evaluate) {
+				device = upower_add_device(state, path);
+				if (device == NULL) {
+					break;
+				}
+				device->type = e->device_type;
+				device->power_supply = e->power_supply;
+			}
+			break;
+		case RECORD_DEVICE_REMOVED:
+			if (upower_decode_device_path(e->msg, &path) > 0 && evaluate) {
+				upower_remove_device(state, path);
+			}
+			break;
+		case RECORD_DEVICE_CHANGED:
+			if (upower_decode_properties_changed(e->msg, 0, &mask, &props) >= 0 && evaluate) {
+				device = find_device(state, sd_bus_message_get_path(e->msg));
+				if (device != NULL) {
+					upower_device_apply(device, mask, &props);
+				}
+			}
+			break;
+		}
+
+		if (device != NULL) {
+			int count = alert_evaluate(&device->last, &device->current, upower_device_has_battery(device), actions);
+			device->last = alert_next_last(&device->last, &device->current);
+			for (int action = 0; action < count && dispatch != NULL; action++) {
+				dispatch_alert(dispatch, device, &actions[action], e->timestamp_ms);
+			}
+			alerts += count;
+		}
+		alerts += state->removed_devices->length;
+		for (int removed = 0; removed < state->removed_devices->length && dispatch != NULL; removed++) {
+			dispatch_alert(dispatch, state->removed_devices->items[removed], alert_removed(), e->timestamp_ms);
+		}
+		if (dispatch != NULL) {
+			dispatch_flush(dispatch, e->timestamp_ms);
+		}
+		while (state->removed_devices->length > 0) {
+			if (dispatch != NULL) {
+				dispatch_forget_device(dispatch, state->removed_devices->items[0]);
+			}
+			upower_device_destroy(state->removed_devices->items[0]);
+			list_del(state->removed_devices, 0);
+		}
+	}
+
+	return alerts;
+}
+
+static int run(struct bench_event *events, size_t len, bool evaluate) {
+	struct upower state = { 0 };
+	if (upower_create_lists(&state) < 0) {
+		return -ENOMEM;
+	}
+	int alerts = run_state(&state, events, len, evaluate, NULL);
+	destroy_upower(NULL, &state);
+	return alerts;
+}
+
+// Like run() with evaluation, but also sends the alerts through what the
+// daemon dispatches them with. In pool mode, all of that is set up front.
+static int run_dispatch(struct bench_event *events, size_t len) {
+	struct bench_dispatch dispatch = { 0 };
+	struct upower state = { 0 };
+	int alerts = -ENOMEM;
+
+	rate_limiter_init(&dispatch.limiter);
+#ifdef POWERALERTD_DEVICE_POOL
+	if (id_map_reserve(&dispatch.ids, POWERALERTD_DEVICE_POOL * 3) < 0) {
+		goto finish;
+	}
+#endif
+	if (dispatch.limiter.buckets == NULL || upower_create_lists(&state) < 0) {
+		goto finish;
+	}
+	alerts = run_state(&state, events, len, true, &dispatch);
+
+finish:
+	destroy_upower(NULL, &state);
+	rate_limiter_finish(&dispatch.limiter);
+	id_map_finish(&dispatch.ids);
+	return alerts;
+}
+
+static void report(const char *name, size_t messages, uint64_t elapsed_us, size_t allocs) {
+	printf("%-12s %10zu messages in %8.3f ms, %12.0f messages/s, %8zu allocations\n",
+		name, messages, elapsed_us / 1000.0,
+		elapsed_us > 0 ? messages * 1000000.0 / elapsed_us : 0.0, allocs);
+}
+
+// Saves the snapshot of the devices the recording leaves behind, first
+// with nothing marked dirty as in most loop passes, then marked dirty but
+// unchanged, which serializes the table without writing it out.
+static int run_snapshot(struct bench_event *events, size_t len, int saves) {
+	char path[] = "/tmp/bench-snapshot-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		return -errno;
+	}
+	close(fd);
+
+	struct snapshot snapshot = { .path = strdup(path) };
+	struct upower state = { 0 };
+	int ret = upower_create_lists(&state);
+	if (ret < 0 || snapshot.path == NULL) {
+		ret = -ENOMEM;
+		goto finish;
+	}
+	run_state(&state, events, len, true, NULL);
+	ret = snapshot_save(&snapshot, &state);
+	if (ret < 0) {
+		goto finish;
+	}
+
+	size_t allocs = allocations;
+	uint64_t start = now_us();
+	for (int i = 0; i < saves && ret == 0; i++) {
+		ret = snapshot_save(&snapshot, &state);
+	}
+	report("snapshot", saves, now_us() - start, allocations - allocs);
+
+	allocs = allocations;
+	start = now_us();
+	for (int i = 0; i < saves && ret == 0; i++) {
+		state.dirty = true;
+		ret = snapshot_save(&snapshot, &state);
+	}
+	report("dirty", saves, now_us() - start, allocations - allocs);
+
+finish:
+	destroy_upower(NULL, &state);
+	snapshot_finish(&snapshot);
+	unlink(path);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <recording> [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+	sd_bus *bus = NULL;
+	int ret = message_bus_new(&bus);
+	if (ret < 0) {
+		fprintf(stderr, "could not create bus: %s\n", strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
+	struct bench_event *events = NULL;
+	size_t len = 0;
+	ret = load(bus, argv[1], &events, &len);
+	if (ret < 0) {
+		fprintf(stderr, "could not load recording %s: %s\n", argv[1], strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
+	size_t allocs = allocations;
+	uint64_t start = now_us();
+	for (int i = 0; i < iterations; i++) {
+		run(events, len, false);
+	}
+	report("decode", len * iterations, now_us() - start, allocations - allocs);
+
+	int alerts = 0;
+	allocs = allocations;
+	start = now_us();
+	for (int i = 0; i < iterations; i++) {
+		alerts = run(events, len, true);
+	}
+	report("evaluate", len * iterations, now_us() - start, allocations - allocs);
+	printf("%d alerts per pass\n", alerts);
+
+	allocs = allocations;
+	start = now_us();
+	for (int i = 0; i < iterations; i++) {
+		run_dispatch(events, len);
+	}
+	report("dispatch", len * iterations, now_us() - start, allocations - allocs);
+
+	ret = run_snapshot(events, len, iterations * 100);
+	if (ret < 0) {
+		fprintf(stderr, "could not save snapshot: %s\n", strerror(-ret));
+	}
+
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) {
+		printf("%ld KiB peak resident set size\n", usage.ru_maxrss);
+	}
+
+	for (size_t idx = 0; idx < len; idx++) {
+		sd_bus_message_unref(events[idx].msg);
+	}
+	free(events);
+	sd_bus_unref(bus);
+	return EXIT_SUCCESS;
+}
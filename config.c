@@ -0,0 +1,434 @@
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "config.h"
+#include "list.h"
+#include "upower.h"
+
+// The config file holds one rule per line, applied in order so that later
+// rules override earlier ones:
+//
+//   ignore <match>           do not track matching devices
+//   notify <match>           track matching devices again
+//   low <percent> <match>    warn below percent while discharging
+//   critical <percent> <match>
+//   limit <count> <seconds> [<category glob>]
+//                            allow count alerts of a category per device
+//                            over seconds, 0 for no limit
+//   hot <celsius> <match>    warn when the battery gets this hot
+//   worn <percent> <match>   warn when the battery holds less than percent
+//                            of its design capacity
+//   details <match>          show energy rate and time remaining
+//
+// where <match> is one of "all", "non-power-supply", "type <type>",
+// "model <glob>" or "native-path <glob>". Lines starting with # are
+// comments. Rules are matched against each device once, when it is added
+// or the file changes, never for every signal.
+
+static void config_rules_free(list_t *rules) {
+	if (rules == NULL) {
+		return;
+	}
+	for (int idx = 0; idx < rules->length; idx++) {
+		struct config_rule *rule = rules->items[idx];
+		free(rule->pattern);
+		free(rule);
+	}
+	list_free(rules);
+}
+
+static char *next_token(char **line) {
+	char *p = *line;
+	while (isspace((unsigned char)*p)) {
+		p++;
+	}
+	if (*p == '\0') {
+		*line = p;
+		return NULL;
+	}
+	char *token = p;
+	while (*p != '\0' && !isspace((unsigned char)*p)) {
+		p++;
+	}
+	if (*p != '\0') {
+		*p++ = '\0';
+	}
+	*line = p;
+	return token;
+}
+
+static char *rest_of_line(char *line) {
+	while (isspace((unsigned char)*line)) {
+		line++;
+	}
+	size_t len = strlen(line);
+	while (len > 0 && isspace((unsigned char)line[len - 1])) {
+		line[--len] = '\0';
+	}
+	return len > 0 ? line : NULL;
+}
+
+static int config_parse_match(struct config_rule *rule, char *line) {
+	char *field = next_token(&line);
+	char *pattern = rest_of_line(line);
+	if (field == NULL) {
+		return -EINVAL;
+	} else if (strcmp(field, "all") == 0) {
+		rule->field = CONFIG_FIELD_ALL;
+	} else if (strcmp(field, "non-power-supply") == 0) {
+		rule->field = CONFIG_FIELD_NON_POWER_SUPPLY;
+	} else if (strcmp(field, "type") == 0 && pattern != NULL) {
+		rule->field = CONFIG_FIELD_TYPE;
+		int type = upower_device_type_int(pattern);
+		if (type < 0) {
+			return -EINVAL;
+		}
+		rule->type = type;
+	} else if (strcmp(field, "model") == 0 && pattern != NULL) {
+		rule->field = CONFIG_FIELD_MODEL;
+		rule->pattern = strdup(pattern);
+	} else if (strcmp(field, "native-path") == 0 && pattern != NULL) {
+		rule->field = CONFIG_FIELD_NATIVE_PATH;
+		rule->pattern = strdup(pattern);
+	} else {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int parse_int(char **line, int max, int *value) {
+	char *token = next_token(line);
+	if (token == NULL) {
+		return -EINVAL;
+	}
+	char *end;
+	long parsed = strtol(token, &end, 10);
+	if (*end != '\0' || parsed < 0 || parsed > max) {
+		return -EINVAL;
+	}
+	*value = parsed;
+	return 0;
+}
+
+static int config_parse_line(list_t *rules, const char *text) {
+	char buf[512];
+	snprintf(buf, sizeof(buf), "%s", text);
+	char *line = buf;
+	int ret;
+
+	char *action = next_token(&line);
+	if (action == NULL || action[0] == '#') {
+		return 0;
+	}
+
+	struct config_rule rule = { 0 };
+	if (strcmp(action, "ignore") == 0) {
+		rule.action = CONFIG_ACTION_IGNORE;
+		ret = config_parse_match(&rule, line);
+	} else if (strcmp(action, "notify") == 0) {
+		rule.action = CONFIG_ACTION_NOTIFY;
+		ret = config_parse_match(&rule, line);
+	} else if (strcmp(action, "low") == 0 || strcmp(action, "critical") == 0 ||
+			strcmp(action, "worn") == 0) {
+		rule.action = action[0] == 'l' ? CONFIG_ACTION_LOW :
+			action[0] == 'c' ? CONFIG_ACTION_CRITICAL : CONFIG_ACTION_WORN;
+		ret = parse_int(&line, 100, &rule.value);
+		if (ret == 0) {
+			ret = config_parse_match(&rule, line);
+		}
+	} else if (strcmp(action, "hot") == 0) {
+		rule.action = CONFIG_ACTION_HOT;
+		ret = parse_int(&line, 200, &rule.value);
+		if (ret == 0) {
+			ret = config_parse_match(&rule, line);
+		}
+	} else if (strcmp(action, "details") == 0) {
+		rule.action = CONFIG_ACTION_DETAILS;
+		ret = config_parse_match(&rule, line);
+	} else if (strcmp(action, "limit") == 0) {
+		rule.action = CONFIG_ACTION_LIMIT;
+		ret = parse_int(&line, INT_MAX, &rule.value);
+		if (ret == 0) {
+			ret = parse_int(&line, INT_MAX / 1000, &rule.period);
+		}
+		char *pattern = rest_of_line(line);
+		if (ret == 0 && pattern != NULL) {
+			rule.pattern = strdup(pattern);
+		}
+	} else {
+		ret = -EINVAL;
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	struct config_rule *copy = malloc(sizeof(struct config_rule));
+	if (copy == NULL) {
+		free(rule.pattern);
+		return -ENOMEM;
+	}
+	*copy = rule;
+	list_add(rules, copy);
+	return 0;
+}
+
+void config_init(struct config *config) {
+	config->path = NULL;
+	config->fd = -1;
+	config->rules = create_list();
+	config->extra_lines = create_list();
+}
+
+static char *config_default_path(void) {
+	const char *home = getenv("XDG_CONFIG_HOME");
+	const char *suffix = "/poweralertd/config";
+	if (home == NULL || home[0] == '\0') {
+		home = getenv("HOME");
+		suffix = "/.config/poweralertd/config";
+	}
+	if (home == NULL) {
+		return NULL;
+	}
+	size_t len = strlen(home) + strlen(suffix) + 1;
+	char *path = malloc(len);
+	if (path != NULL) {
+		snprintf(path, len, "%s%s", home, suffix);
+	}
+	return path;
+}
+
+void config_finish(struct config *config) {
+	config_rules_free(config->rules);
+	config->rules = NULL;
+	if (config->extra_lines != NULL) {
+		for (int idx = 0; idx < config->extra_lines->length; idx++) {
+			free(config->extra_lines->items[idx]);
+		}
+		list_free(config->extra_lines);
+		config->extra_lines = NULL;
+	}
+	if (config->fd != -1) {
+		close(config->fd);
+		config->fd = -1;
+	}
+	free(config->path);
+	config->path = NULL;
+}
+
+int config_add_line(struct config *config, const char *line) {
+	list_t *rules = create_list();
+	int ret = config_parse_line(rules, line);
+	config_rules_free(rules);
+	if (ret < 0) {
+		return ret;
+	}
+	list_add(config->extra_lines, strdup(line));
+	return 0;
+}
+
+static int config_watch(struct config *config) {
+	if (config->fd != -1 || config->path == NULL) {
+		return 0;
+	}
+
+	config->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (config->fd == -1) {
+		return -errno;
+	}
+
+	// Editors tend to replace files rather than write them, so watch the
+	// directory
+	char *dir = strdup(config->path);
+	if (dir == NULL) {
+		return -ENOMEM;
+	}
+	char *slash = strrchr(dir, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	int ret = inotify_add_watch(config->fd, slash == dir ? "/" : (slash != NULL ? dir : "."),
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+	free(dir);
+	if (ret == -1) {
+		// No config directory is no config at all
+		close(config->fd);
+		config->fd = -1;
+	}
+	return 0;
+}
+
+// Parses the config file into a fresh rule set, which only replaces the
+// current one if the whole file parsed. A missing file is an empty one.
+static int config_reload(struct config *config) {
+	list_t *rules = create_list();
+	int ret = 0;
+
+	FILE *f = config->path != NULL ? fopen(config->path, "r") : NULL;
+	if (f == NULL && config->path != NULL && errno != ENOENT) {
+		ret = -errno;
+		fprintf(stderr, "could not open config %s: %s\n", config->path, strerror(-ret));
+		goto error;
+	}
+
+	if (f != NULL) {
+		char *line = NULL;
+		size_t cap = 0;
+		int lineno = 0;
+		while (getline(&line, &cap, f) != -1) {
+			lineno++;
+			ret = config_parse_line(rules, line);
+			if (ret < 0) {
+				fprintf(stderr, "%s:%d: invalid rule\n", config->path, lineno);
+				break;
+			}
+		}
+		free(line);
+		fclose(f);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	for (int idx = 0; idx < config->extra_lines->length; idx++) {
+		ret = config_parse_line(rules, config->extra_lines->items[idx]);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	config_rules_free(config->rules);
+	config->rules = rules;
+	return config_watch(config);
+
+error:
+	config_rules_free(rules);
+	return ret;
+}
+
+// Loads path, or the default config file if NULL, and starts watching it.
+int config_load(struct config *config, const char *path) {
+	free(config->path);
+	config->path = path != NULL ? strdup(path) : config_default_path();
+	return config_reload(config);
+}
+
+// Returns 1 if the config file changed and was reloaded, 0 otherwise.
+int config_process(struct config *config) {
+	if (config->fd == -1) {
+		return 0;
+	}
+
+	const char *name = strrchr(config->path, '/');
+	name = name != NULL ? name + 1 : config->path;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+	while ((len = read(config->fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			if (event->len > 0 && strcmp(event->name, name) == 0) {
+				changed = true;
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	if (!changed) {
+		return 0;
+	}
+
+	int ret = config_reload(config);
+	if (ret < 0) {
+		fprintf(stderr, "keeping previous config\n");
+		return 0;
+	}
+	return 1;
+}
+
+static bool config_rule_matches(struct config_rule *rule, struct upower_device *device) {
+	switch (rule->field) {
+	case CONFIG_FIELD_ALL:
+		return true;
+	case CONFIG_FIELD_NON_POWER_SUPPLY:
+		return !device->power_supply;
+	case CONFIG_FIELD_TYPE:
+		return device->type == rule->type;
+	case CONFIG_FIELD_MODEL:
+		return fnmatch(rule->pattern, device->model != NULL ? device->model : "", 0) == 0;
+	case CONFIG_FIELD_NATIVE_PATH:
+		return fnmatch(rule->pattern, device->native_path != NULL ? device->native_path : "", 0) == 0;
+	}
+	return false;
+}
+
+void config_device_policy(struct config *config, struct upower_device *device, struct upower_device_policy *policy) {
+	*policy = (struct upower_device_policy){ 0 };
+	for (int idx = 0; idx < config->rules->length; idx++) {
+		struct config_rule *rule = config->rules->items[idx];
+		if (rule->action == CONFIG_ACTION_LIMIT || !config_rule_matches(rule, device)) {
+			continue;
+		}
+		switch (rule->action) {
+		case CONFIG_ACTION_IGNORE:
+			policy->ignored = true;
+			break;
+		case CONFIG_ACTION_NOTIFY:
+			policy->ignored = false;
+			break;
+		case CONFIG_ACTION_LOW:
+			policy->low = rule->value;
+			break;
+		case CONFIG_ACTION_CRITICAL:
+			policy->critical = rule->value;
+			break;
+		case CONFIG_ACTION_HOT:
+			policy->hot = rule->value;
+			break;
+		case CONFIG_ACTION_WORN:
+			policy->worn = rule->value;
+			break;
+		case CONFIG_ACTION_DETAILS:
+			policy->details = true;
+			break;
+		case CONFIG_ACTION_LIMIT:
+			break;
+		}
+	}
+
+	// Extended properties are decoded for nothing but these rules
+	if (policy->hot > 0) {
+		policy->props |= UPOWER_DEVICE_PROP_TEMPERATURE;
+	}
+	if (policy->worn > 0) {
+		policy->props |= UPOWER_DEVICE_PROP_CAPACITY;
+	}
+	if (policy->details) {
+		policy->props |= UPOWER_DEVICE_PROP_ENERGY_RATE | UPOWER_DEVICE_PROP_TIME_TO_EMPTY |
+			UPOWER_DEVICE_PROP_TIME_TO_FULL;
+	}
+}
+
+// Looks up how many alerts of a category a device may cause per period,
+// in seconds. A count of 0 means no limit.
+void config_rate_limit(struct config *config, const char *category, int *count, int *period) {
+	*count = CONFIG_DEFAULT_LIMIT_COUNT;
+	*period = CONFIG_DEFAULT_LIMIT_PERIOD;
+	for (int idx = 0; idx < config->rules->length; idx++) {
+		struct config_rule *rule = config->rules->items[idx];
+		if (rule->action != CONFIG_ACTION_LIMIT) {
+			continue;
+		}
+		if (rule->pattern == NULL || fnmatch(rule->pattern, category, 0) == 0) {
+			*count = rule->value;
+			*period = rule->period;
+		}
+	}
+}
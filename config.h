@@ -0,0 +1,60 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include "list.h"
+#include "upower.h"
+
+// Alerts of a category a single device may cause per period in seconds,
+// unless configured otherwise
+#define CONFIG_DEFAULT_LIMIT_COUNT 5
+#define CONFIG_DEFAULT_LIMIT_PERIOD 60
+
+enum config_field {
+	CONFIG_FIELD_ALL,
+	CONFIG_FIELD_TYPE,
+	CONFIG_FIELD_MODEL,
+	CONFIG_FIELD_NATIVE_PATH,
+	CONFIG_FIELD_NON_POWER_SUPPLY,
+};
+
+enum config_action {
+	CONFIG_ACTION_IGNORE,
+	CONFIG_ACTION_NOTIFY,
+	CONFIG_ACTION_LOW,
+	CONFIG_ACTION_CRITICAL,
+	CONFIG_ACTION_LIMIT,
+	CONFIG_ACTION_HOT,
+	CONFIG_ACTION_WORN,
+	CONFIG_ACTION_DETAILS,
+};
+
+struct config_rule {
+	enum config_action action;
+	int value;
+	// Seconds over which value alerts are allowed, for limits
+	int period;
+	enum config_field field;
+	enum upower_device_type type;
+	char *pattern;
+};
+
+struct config {
+	char *path;
+	list_t *rules;
+
+	// Rules from the command line, applied after those of the file
+	list_t *extra_lines;
+
+	// inotify descriptor watching the directory of path, or -1
+	int fd;
+};
+
+void config_init(struct config *config);
+void config_finish(struct config *config);
+int config_add_line(struct config *config, const char *line);
+int config_load(struct config *config, const char *path);
+int config_process(struct config *config);
+void config_device_policy(struct config *config, struct upower_device *device, struct upower_device_policy *policy);
+void config_rate_limit(struct config *config, const char *category, int *count, int *period);
+
+#endif
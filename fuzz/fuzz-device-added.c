@@ -0,0 +1,36 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dbus.h"
+#include "list.h"
+#include "message.h"
+#include "upower.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static sd_bus *bus = NULL;
+	if (bus == NULL && message_bus_new(&bus) < 0) {
+		return 0;
+	}
+
+	sd_bus_message *msg = NULL;
+	if (message_device_signal_fuzz(bus, &msg, data, size) < 0) {
+		return 0;
+	}
+
+	// No bus on the state, so devices are tracked without subscribing
+	struct upower state = {
+		.devices = create_list(),
+		.removed_devices = create_list(),
+	};
+	const char *path = NULL;
+	if (upower_decode_device_path(msg, &path) > 0) {
+		upower_add_device(&state, path);
+		upower_add_device(&state, path);
+		upower_remove_device(&state, path);
+		upower_add_device(&state, path);
+	}
+
+	destroy_upower(NULL, &state);
+	sd_bus_message_unref(msg);
+	return 0;
+}
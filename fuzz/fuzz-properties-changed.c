@@ -0,0 +1,31 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dbus.h"
+#include "message.h"
+#include "upower.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static sd_bus *bus = NULL;
+	if (bus == NULL && message_bus_new(&bus) < 0) {
+		return 0;
+	}
+
+	sd_bus_message *msg = NULL;
+	if (message_properties_changed_fuzz(bus, &msg, data, size) < 0) {
+		return 0;
+	}
+
+	struct upower_device device = { 0 };
+	struct upower_device_props props = { 0 };
+	uint32_t mask = 0;
+	if (upower_decode_properties_changed(msg, UPOWER_DEVICE_PROPS_EXTENDED, &mask, &props) >= 0) {
+		upower_device_apply(&device, mask, &props);
+		upower_device_state_string(&device);
+		upower_device_warning_level_string(&device);
+		upower_device_battery_level_string(&device);
+	}
+
+	sd_bus_message_unref(msg);
+	return 0;
+}
@@ -0,0 +1,297 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dbus.h"
+#include "message.h"
+#include "upower.h"
+
+int message_bus_new(sd_bus **bus) {
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds) == -1) {
+		return -errno;
+	}
+
+	int ret = sd_bus_new(bus);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_set_fd(*bus, fds[0], fds[0]);
+	if (ret < 0) {
+		goto error;
+	}
+	// Starting only sends the authentication request, which nobody will
+	// ever answer. That is enough to create and seal messages.
+	ret = sd_bus_start(*bus);
+	if (ret < 0) {
+		goto error;
+	}
+	close(fds[1]);
+	return 0;
+
+error:
+	*bus = sd_bus_unref(*bus);
+	close(fds[0]);
+	close(fds[1]);
+	return ret;
+}
+
+static int message_finish(sd_bus_message *msg) {
+	static uint64_t cookie = 1;
+	int ret = sd_bus_message_seal(msg, cookie++, 0);
+	if (ret < 0) {
+		return ret;
+	}
+	return sd_bus_message_rewind(msg, 1);
+}
+
+int message_properties_changed(sd_bus *bus, sd_bus_message **msg, const char *path,
+		uint32_t mask, const struct upower_device_props *props) {
+	int ret = sd_bus_message_new_signal(bus, msg, path,
+		"org.freedesktop.DBus.Properties", "PropertiesChanged");
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_message_append(*msg, "s", "org.freedesktop.UPower.Device");
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_open_container(*msg, 'a', "{sv}");
+	if (ret < 0) {
+		goto error;
+	}
+	if (ret >= 0 && (mask & UPOWER_DEVICE_PROP_ONLINE)) {
+		ret = sd_bus_message_append(*msg, "{sv}", "Online", "b", props->online);
+	}
+	if (ret >= 0 && (mask & UPOWER_DEVICE_PROP_PERCENTAGE)) {
+		ret = sd_bus_message_append(*msg, "{sv}", "Percentage", "d", props->percentage);
+	}
+	if (ret >= 0 && (mask & UPOWER_DEVICE_PROP_STATE)) {
+		ret = sd_bus_message_append(*msg, "{sv}", "State", "u", (uint32_t)props->state);
+	}
+	if (ret >= 0 && (mask & UPOWER_DEVICE_PROP_WARNING_LEVEL)) {
+		ret = sd_bus_message_append(*msg, "{sv}", "WarningLevel", "u", (uint32_t)props->warning_level);
+	}
+	if (ret >= 0 && (mask & UPOWER_DEVICE_PROP_BATTERY_LEVEL)) {
+		ret = sd_bus_message_append(*msg, "{sv}", "BatteryLevel", "u", (uint32_t)props->battery_level);
+	}
+	for (size_t idx = 0; ret >= 0 && idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+		const struct upower_extended_prop *prop = &upower_extended_props[idx];
+		if (!(mask & prop->bit)) {
+			continue;
+		}
+		ret = sd_bus_message_open_container(*msg, 'e', "sv");
+		if (ret >= 0) {
+			ret = sd_bus_message_append_basic(*msg, 's', prop->name);
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_open_container(*msg, 'v', prop->signature);
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_append_basic(*msg, prop->signature[0], (const char *)props + prop->offset);
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_close_container(*msg);
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_close_container(*msg);
+		}
+	}
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_close_container(*msg);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_append(*msg, "as", 0);
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = message_finish(*msg);
+	if (ret < 0) {
+		goto error;
+	}
+	return 0;
+
+error:
+	*msg = sd_bus_message_unref(*msg);
+	return ret;
+}
+
+int message_device_signal(sd_bus *bus, sd_bus_message **msg, const char *member, const char *path) {
+	int ret = sd_bus_message_new_signal(bus, msg, "/org/freedesktop/UPower",
+		"org.freedesktop.UPower", member);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_message_append(*msg, "o", path);
+	if (ret >= 0) {
+		ret = message_finish(*msg);
+	}
+	if (ret < 0) {
+		*msg = sd_bus_message_unref(*msg);
+	}
+	return ret;
+}
+
+struct fuzz_input {
+	const uint8_t *data;
+	size_t size;
+};
+
+static uint8_t next_byte(struct fuzz_input *in) {
+	if (in->size == 0) {
+		return 0;
+	}
+	in->size--;
+	return *in->data++;
+}
+
+static void next_bytes(struct fuzz_input *in, void *buf, size_t len) {
+	memset(buf, 0, len);
+	if (len > in->size) {
+		len = in->size;
+	}
+	memcpy(buf, in->data, len);
+	in->data += len;
+	in->size -= len;
+}
+
+static void next_string(struct fuzz_input *in, char *buf, size_t max) {
+	size_t len = next_byte(in) % max;
+	next_bytes(in, buf, len);
+	buf[len] = '\0';
+}
+
+// Appends a single value of a type picked by the input.
+static int append_value(sd_bus_message *msg, struct fuzz_input *in) {
+	static const char types[] = "ubdsiyt";
+	char type = types[next_byte(in) % (sizeof(types) - 1)];
+	char contents[2] = { type, '\0' };
+	char str[64];
+	uint64_t value;
+
+	int ret = sd_bus_message_open_container(msg, 'v', contents);
+	if (ret < 0) {
+		return ret;
+	}
+	if (type == 's') {
+		next_string(in, str, sizeof(str));
+		ret = sd_bus_message_append_basic(msg, type, str);
+	} else if (type == 'b') {
+		int b = next_byte(in) & 1;
+		ret = sd_bus_message_append_basic(msg, type, &b);
+	} else {
+		next_bytes(in, &value, sizeof(value));
+		ret = sd_bus_message_append_basic(msg, type, &value);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+	return sd_bus_message_close_container(msg);
+}
+
+int message_properties_changed_fuzz(sd_bus *bus, sd_bus_message **msg, const uint8_t *data, size_t size) {
+	static const char *names[] = {
+		"State", "WarningLevel", "BatteryLevel", "Online", "Percentage",
+		"EnergyRate", "TimeToEmpty", "TimeToFull", "Temperature", "Capacity",
+		"Model", "Type", "",
+	};
+	struct fuzz_input in = { data, size };
+	char name[64];
+
+	int ret = sd_bus_message_new_signal(bus, msg, "/org/freedesktop/UPower/devices/battery_BAT0",
+		"org.freedesktop.DBus.Properties", "PropertiesChanged");
+	if (ret < 0) {
+		return ret;
+	}
+
+	// The first byte decides which parts of the signature are present
+	uint8_t shape = next_byte(&in);
+	if (!(shape & 1)) {
+		ret = sd_bus_message_append(*msg, "s", "org.freedesktop.UPower.Device");
+	}
+	if (ret >= 0 && !(shape & 2)) {
+		ret = sd_bus_message_open_container(*msg, 'a', "{sv}");
+		while (ret >= 0 && in.size > 0) {
+			uint8_t op = next_byte(&in);
+			if (op == 0xff) {
+				break;
+			}
+			size_t idx = op % (sizeof(names) / sizeof(names[0]) + 1);
+			if (idx < sizeof(names) / sizeof(names[0])) {
+				snprintf(name, sizeof(name), "%s", names[idx]);
+			} else {
+				next_string(&in, name, sizeof(name));
+			}
+			ret = sd_bus_message_open_container(*msg, 'e', "sv");
+			if (ret >= 0) {
+				ret = sd_bus_message_append_basic(*msg, 's', name);
+			}
+			if (ret >= 0) {
+				ret = append_value(*msg, &in);
+			}
+			if (ret >= 0) {
+				ret = sd_bus_message_close_container(*msg);
+			}
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_close_container(*msg);
+		}
+	}
+	if (ret >= 0 && !(shape & 4)) {
+		ret = sd_bus_message_open_container(*msg, 'a', "s");
+		while (ret >= 0 && in.size > 0) {
+			next_string(&in, name, sizeof(name));
+			ret = sd_bus_message_append_basic(*msg, 's', name);
+		}
+		if (ret >= 0) {
+			ret = sd_bus_message_close_container(*msg);
+		}
+	}
+	if (ret >= 0) {
+		ret = message_finish(*msg);
+	}
+	if (ret < 0) {
+		*msg = sd_bus_message_unref(*msg);
+	}
+	return ret;
+}
+
+int message_device_signal_fuzz(sd_bus *bus, sd_bus_message **msg, const uint8_t *data, size_t size) {
+	struct fuzz_input in = { data, size };
+	char path[256];
+
+	int ret = sd_bus_message_new_signal(bus, msg, "/org/freedesktop/UPower",
+		"org.freedesktop.UPower", "DeviceAdded");
+	if (ret < 0) {
+		return ret;
+	}
+
+	uint8_t shape = next_byte(&in);
+	next_string(&in, path, sizeof(path));
+	if (shape & 1) {
+		// Object paths are validated on append, so bad ones end up as
+		// strings to exercise the signature mismatch instead.
+		ret = sd_bus_message_append_basic(*msg, 'o', path);
+		if (ret == -EINVAL) {
+			ret = sd_bus_message_append_basic(*msg, 's', path);
+		}
+	} else if (shape & 2) {
+		ret = sd_bus_message_append_basic(*msg, 's', path);
+	}
+	if (ret >= 0) {
+		ret = message_finish(*msg);
+	}
+	if (ret < 0) {
+		*msg = sd_bus_message_unref(*msg);
+	}
+	return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef _FUZZ_MESSAGE_H
+#define _FUZZ_MESSAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dbus.h"
+#include "upower.h"
+
+// A bus that is never connected to a peer, only used to build messages.
+int message_bus_new(sd_bus **bus);
+
+int message_properties_changed(sd_bus *bus, sd_bus_message **msg, const char *path,
+		uint32_t mask, const struct upower_device_props *props);
+int message_device_signal(sd_bus *bus, sd_bus_message **msg, const char *member, const char *path);
+
+// Builds a PropertiesChanged-shaped signal from arbitrary bytes. The
+// result is a valid D-Bus message, but may deviate from the expected
+// signature anywhere.
+int message_properties_changed_fuzz(sd_bus *bus, sd_bus_message **msg, const uint8_t *data, size_t size);
+int message_device_signal_fuzz(sd_bus *bus, sd_bus_message **msg, const uint8_t *data, size_t size);
+
+#endif
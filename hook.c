@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "hook.h"
+#include "list.h"
+#include "upower.h"
+
+extern char **environ;
+
+static uint64_t now_ms(void) {
+	struct timespec current;
+	if (clock_gettime(CLOCK_MONOTONIC, &current) == -1) {
+		return 0;
+	}
+
+	return (uint64_t)current.tv_sec * 1000 + current.tv_nsec / 1000000;
+}
+
+int hooks_init(struct hooks *hooks) {
+	hooks->hooks = create_list();
+	hooks->running = create_list();
+	hooks->pending = create_list();
+	hooks->max_running = 4;
+	hooks->timeout_ms = 30000;
+	hooks->fd = -1;
+	return 0;
+}
+
+static void hook_job_destroy(struct hook_job *job) {
+	for (size_t idx = 0; idx < sizeof(job->env) / sizeof(job->env[0]); idx++) {
+		free(job->env[idx]);
+	}
+	free(job);
+}
+
+void hooks_destroy(struct hooks *hooks) {
+	if (hooks->hooks != NULL) {
+		for (int idx = 0; idx < hooks->hooks->length; idx++) {
+			struct hook *hook = hooks->hooks->items[idx];
+			free(hook->category);
+			free(hook->command);
+			free(hook);
+		}
+		list_free(hooks->hooks);
+		hooks->hooks = NULL;
+	}
+	if (hooks->pending != NULL) {
+		for (int idx = 0; idx < hooks->pending->length; idx++) {
+			hook_job_destroy(hooks->pending->items[idx]);
+		}
+		list_free(hooks->pending);
+		hooks->pending = NULL;
+	}
+	if (hooks->running != NULL) {
+		// Running hooks are left to finish on their own
+		for (int idx = 0; idx < hooks->running->length; idx++) {
+			free(hooks->running->items[idx]);
+		}
+		list_free(hooks->running);
+		hooks->running = NULL;
+	}
+	if (hooks->fd != -1) {
+		close(hooks->fd);
+		hooks->fd = -1;
+	}
+}
+
+// Hooks are specified as <category>=<command>, and the command is run
+// through /bin/sh.
+int hooks_add(struct hooks *hooks, char *spec) {
+	char *sep = strchr(spec, '=');
+	if (sep == NULL || sep == spec || sep[1] == '\0') {
+		return -EINVAL;
+	}
+
+	if (hooks->fd == -1) {
+		// SIGCHLD is only ever consumed through the signalfd
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGCHLD);
+		if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+			return -errno;
+		}
+		hooks->fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (hooks->fd == -1) {
+			return -errno;
+		}
+	}
+
+	struct hook *hook = calloc(1, sizeof(struct hook));
+	if (hook == NULL) {
+		return -ENOMEM;
+	}
+	hook->category = strndup(spec, sep - spec);
+	hook->command = strdup(sep + 1);
+	if (hook->category == NULL || hook->command == NULL ||
+			list_add(hooks->hooks, hook) < 0) {
+		free(hook->category);
+		free(hook->command);
+		free(hook);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int hook_spawn(struct hooks *hooks, struct hook_job *job) {
+	// Allocated up front, so that a spawned child is never left untracked
+	struct hook_child *child = calloc(1, sizeof(struct hook_child));
+	if (child == NULL) {
+		return -ENOMEM;
+	}
+
+	posix_spawnattr_t attr;
+	int ret = posix_spawnattr_init(&attr);
+	if (ret != 0) {
+		free(child);
+		return -ret;
+	}
+
+	// Children must not inherit our blocked SIGCHLD, and get their own
+	// process group so that a timeout can take down the whole pipeline.
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setpgroup(&attr, 0);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+	int env_len = 0;
+	while (environ[env_len] != NULL) {
+		env_len++;
+	}
+	size_t extra = sizeof(job->env) / sizeof(job->env[0]);
+	char **envp = calloc(env_len + extra + 1, sizeof(char *));
+	if (envp == NULL) {
+		posix_spawnattr_destroy(&attr);
+		free(child);
+		return -ENOMEM;
+	}
+	int envp_len = 0;
+	for (size_t idx = 0; idx < extra; idx++) {
+		if (job->env[idx] != NULL) {
+			envp[envp_len++] = job->env[idx];
+		}
+	}
+	for (int idx = 0; idx < env_len; idx++) {
+		if (strncmp(environ[idx], "POWERALERTD_", 12) != 0) {
+			envp[envp_len++] = environ[idx];
+		}
+	}
+
+	char *argv[] = { "/bin/sh", "-c", job->hook->command, NULL };
+	pid_t pid;
+	ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp);
+	free(envp);
+	posix_spawnattr_destroy(&attr);
+	if (ret != 0) {
+		fprintf(stderr, "could not run hook for %s: %s\n", job->hook->category, strerror(ret));
+		free(child);
+		return -ret;
+	}
+
+	child->pid = pid;
+	child->hook = job->hook;
+	// A timeout of 0 lets hooks run for as long as they like
+	child->deadline = hooks->timeout_ms > 0 ? now_ms() + hooks->timeout_ms : 0;
+	if (list_add(hooks->running, child) < 0) {
+		// Nothing would reap it later, so take it down right away
+		fprintf(stderr, "could not track hook for %s, killing\n", job->hook->category);
+		kill(-pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		free(child);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static char *hook_env(const char *key, const char *value) {
+	size_t len = strlen(key) + strlen(value) + 2;
+	char *env = malloc(len);
+	if (env != NULL) {
+		snprintf(env, len, "%s=%s", key, value);
+	}
+	return env;
+}
+
+int hooks_run(struct hooks *hooks, const char *category, struct upower_device *device) {
+	for (int idx = 0; idx < hooks->hooks->length; idx++) {
+		struct hook *hook = hooks->hooks->items[idx];
+		if (strcmp(hook->category, category) != 0) {
+			continue;
+		}
+
+		bool queue = hooks->running->length >= hooks->max_running;
+		if (queue && hooks->pending->length >= HOOK_PENDING_MAX) {
+			fprintf(stderr, "dropped %s hook, too many pending\n", category);
+			continue;
+		}
+
+		struct hook_job *job = calloc(1, sizeof(struct hook_job));
+		if (job == NULL) {
+			return -ENOMEM;
+		}
+		job->hook = hook;
+		job->env[0] = hook_env("POWERALERTD_CATEGORY", category);
+		job->env[1] = hook_env("POWERALERTD_PATH", device->path ? device->path : "");
+		job->env[2] = hook_env("POWERALERTD_NATIVE_PATH", device->native_path ? device->native_path : "");
+		job->env[3] = hook_env("POWERALERTD_MODEL", device->model ? device->model : "");
+		job->env[4] = hook_env("POWERALERTD_TYPE", upower_device_type_string(device));
+
+		if (queue) {
+			if (list_add(hooks->pending, job) < 0) {
+				hook_job_destroy(job);
+				return -ENOMEM;
+			}
+			continue;
+		}
+
+		int ret = hook_spawn(hooks, job);
+		hook_job_destroy(job);
+		if (ret == -ENOMEM) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+// Reaps exited hooks, kills those that overran their timeout and starts
+// queued ones as slots become available. Never blocks.
+int hooks_process(struct hooks *hooks) {
+	if (hooks->fd == -1) {
+		return 0;
+	}
+
+	struct signalfd_siginfo info;
+	while (read(hooks->fd, &info, sizeof(info)) == sizeof(info)) {
+		// Drain, SIGCHLD coalesces so we check every child below
+	}
+
+	uint64_t now = now_ms();
+	for (int idx = 0; idx < hooks->running->length; idx++) {
+		struct hook_child *child = hooks->running->items[idx];
+		int status;
+		pid_t pid = waitpid(child->pid, &status, WNOHANG);
+		if (pid == child->pid || (pid == -1 && errno == ECHILD)) {
+			if (pid == child->pid && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+				fprintf(stderr, "hook for %s exited with status %d\n", child->hook->category, WEXITSTATUS(status));
+			}
+			free(child);
+			list_del(hooks->running, idx--);
+			continue;
+		}
+
+		if (child->deadline != 0 && now >= child->deadline) {
+			fprintf(stderr, "hook for %s timed out, killing\n", child->hook->category);
+			kill(-child->pid, SIGKILL);
+			// Reaped on the following SIGCHLD
+			child->deadline = 0;
+		}
+	}
+
+	while (hooks->pending->length > 0 && hooks->running->length < hooks->max_running) {
+		struct hook_job *job = hooks->pending->items[0];
+		list_del(hooks->pending, 0);
+		int ret = hook_spawn(hooks, job);
+		hook_job_destroy(job);
+		if (ret == -ENOMEM) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+// Returns the earliest CLOCK_MONOTONIC millisecond at which a running hook
+// times out, or UINT64_MAX if there is none.
+uint64_t hooks_next_deadline(struct hooks *hooks) {
+	uint64_t deadline = UINT64_MAX;
+	if (hooks->running == NULL) {
+		return deadline;
+	}
+	for (int idx = 0; idx < hooks->running->length; idx++) {
+		struct hook_child *child = hooks->running->items[idx];
+		if (child->deadline != 0 && child->deadline < deadline) {
+			deadline = child->deadline;
+		}
+	}
+	return deadline;
+}
@@ -0,0 +1,50 @@
+#ifndef _HOOK_H
+#define _HOOK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "list.h"
+#include "upower.h"
+
+// Hooks waiting for a free slot beyond this are dropped
+#define HOOK_PENDING_MAX 64
+
+// A command to run whenever a notification of the given category is sent.
+struct hook {
+	char *category;
+	char *command;
+};
+
+struct hook_child {
+	pid_t pid;
+	uint64_t deadline;
+	struct hook *hook;
+};
+
+struct hook_job {
+	struct hook *hook;
+	char *env[5];
+};
+
+struct hooks {
+	list_t *hooks;
+	list_t *running;
+	list_t *pending;
+	int max_running;
+
+	// How long a hook may run before it is killed, 0 for no limit
+	uint64_t timeout_ms;
+
+	// signalfd for SIGCHLD, -1 if no hooks are configured
+	int fd;
+};
+
+int hooks_init(struct hooks *hooks);
+void hooks_destroy(struct hooks *hooks);
+int hooks_add(struct hooks *hooks, char *spec);
+int hooks_run(struct hooks *hooks, const char *category, struct upower_device *device);
+int hooks_process(struct hooks *hooks);
+uint64_t hooks_next_deadline(struct hooks *hooks);
+
+#endif
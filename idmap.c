@@ -0,0 +1,127 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "idmap.h"
+
+#define ID_MAP_MIN_CAPACITY 16
+
+static size_t id_map_index(const struct id_map *map, uint32_t id) {
+	uint32_t hash = id * 0x9e3779b1u;
+	return (hash ^ (hash >> 16)) & (map->capacity - 1);
+}
+
+void id_map_finish(struct id_map *map) {
+	free(map->entries);
+	map->entries = NULL;
+	map->capacity = map->length = 0;
+}
+
+void id_map_clear(struct id_map *map) {
+	if (map->entries != NULL) {
+		memset(map->entries, 0, map->capacity * sizeof(struct id_map_entry));
+	}
+	map->length = 0;
+}
+
+static int id_map_resize(struct id_map *map, size_t capacity) {
+	struct id_map_entry *entries = calloc(capacity, sizeof(struct id_map_entry));
+	if (entries == NULL) {
+		return -ENOMEM;
+	}
+
+	struct id_map old = *map;
+	map->entries = entries;
+	map->capacity = capacity;
+	map->length = 0;
+	for (size_t idx = 0; idx < old.capacity; idx++) {
+		if (old.entries[idx].id != 0) {
+			id_map_put(map, old.entries[idx].id, old.entries[idx].slot);
+		}
+	}
+	free(old.entries);
+	return 0;
+}
+
+// Kept at most half full, so that probes stay short
+static int id_map_grow(struct id_map *map) {
+	return id_map_resize(map, map->capacity > 0 ? map->capacity * 2 : ID_MAP_MIN_CAPACITY);
+}
+
+int id_map_reserve(struct id_map *map, size_t length) {
+	size_t capacity = map->capacity > 0 ? map->capacity : ID_MAP_MIN_CAPACITY;
+	while (length * 2 > capacity) {
+		capacity *= 2;
+	}
+	return capacity > map->capacity ? id_map_resize(map, capacity) : 0;
+}
+
+int id_map_put(struct id_map *map, uint32_t id, uint32_t *slot) {
+	if (id == 0) {
+		return -EINVAL;
+	}
+	if ((map->length + 1) * 2 > map->capacity) {
+		int ret = id_map_grow(map);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	size_t idx = id_map_index(map, id);
+	while (map->entries[idx].id != 0 && map->entries[idx].id != id) {
+		idx = (idx + 1) & (map->capacity - 1);
+	}
+	if (map->entries[idx].id == 0) {
+		map->length++;
+	}
+	map->entries[idx] = (struct id_map_entry){ .id = id, .slot = slot };
+	return 0;
+}
+
+uint32_t *id_map_take(struct id_map *map, uint32_t id) {
+	if (id == 0 || map->length == 0) {
+		return NULL;
+	}
+
+	size_t mask = map->capacity - 1;
+	size_t idx = id_map_index(map, id);
+	while (map->entries[idx].id != id) {
+		if (map->entries[idx].id == 0) {
+			return NULL;
+		}
+		idx = (idx + 1) & mask;
+	}
+	uint32_t *slot = map->entries[idx].slot;
+	map->entries[idx].id = 0;
+	map->length--;
+
+	// Moves later entries of the probe sequence into the hole, unless
+	// that would put them before where their probe starts
+	for (size_t next = (idx + 1) & mask; map->entries[next].id != 0; next = (next + 1) & mask) {
+		size_t home = id_map_index(map, map->entries[next].id);
+		if (((next - home) & mask) >= ((next - idx) & mask)) {
+			map->entries[idx] = map->entries[next];
+			map->entries[next].id = 0;
+			idx = next;
+		}
+	}
+	return slot;
+}
+
+int id_map_update(struct id_map *map, uint32_t *slot, uint32_t previous) {
+	if (*slot == previous) {
+		return 0;
+	}
+	id_map_take(map, previous);
+	return *slot != 0 ? id_map_put(map, *slot, slot) : 0;
+}
+
+void id_map_close(struct id_map *map, uint32_t id) {
+	uint32_t *slot = id_map_take(map, id);
+	if (slot != NULL && *slot == id) {
+		*slot = 0;
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef _IDMAP_H
+#define _IDMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps notification IDs back to the slot holding them, so that a signal
+// about a notification finds its device in constant time. Open addressing
+// with linear probing, where ID 0, never handed out by servers, marks a
+// free entry.
+struct id_map_entry {
+	uint32_t id;
+	uint32_t *slot;
+};
+
+struct id_map {
+	struct id_map_entry *entries;
+	size_t capacity;
+	size_t length;
+};
+
+void id_map_finish(struct id_map *map);
+void id_map_clear(struct id_map *map);
+
+// Makes room for length IDs up front, so that putting them never grows
+int id_map_reserve(struct id_map *map, size_t length);
+
+int id_map_put(struct id_map *map, uint32_t id, uint32_t *slot);
+
+// Removes an ID, returning the slot it was held in or NULL if unknown
+uint32_t *id_map_take(struct id_map *map, uint32_t id);
+
+// Follows a slot that was just written, having held previous before
+int id_map_update(struct id_map *map, uint32_t *slot, uint32_t previous);
+
+// Clears the slot holding a notification that is gone, so that the next
+// notification for it is a new one rather than an attempt at replacing it
+void id_map_close(struct id_map *map, uint32_t id);
+
+#endif
@@ -1,25 +1,39 @@
 #define _POSIX_C_SOURCE 200809L
 #include "list.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-list_t *create_list(void) {
+list_t *create_list_with_capacity(int capacity) {
 	list_t *list = malloc(sizeof(list_t));
 	if (!list) {
 		return NULL;
 	}
-	list->capacity = 10;
+	list->capacity = capacity;
 	list->length = 0;
 	list->items = malloc(sizeof(void*) * list->capacity);
+	if (!list->items) {
+		free(list);
+		return NULL;
+	}
 	return list;
 }
 
-static void list_resize(list_t *list) {
+list_t *create_list(void) {
+	return create_list_with_capacity(10);
+}
+
+static int list_resize(list_t *list) {
 	if (list->length == list->capacity) {
+		void **items = realloc(list->items, sizeof(void*) * list->capacity * 2);
+		if (!items) {
+			return -ENOMEM;
+		}
+		list->items = items;
 		list->capacity *= 2;
-		list->items = realloc(list->items, sizeof(void*) * list->capacity);
 	}
+	return 0;
 }
 
 void list_free(list_t *list) {
@@ -30,16 +44,22 @@ void list_free(list_t *list) {
 	free(list);
 }
 
-void list_add(list_t *list, void *item) {
-	list_resize(list);
+int list_add(list_t *list, void *item) {
+	if (list_resize(list) < 0) {
+		return -ENOMEM;
+	}
 	list->items[list->length++] = item;
+	return 0;
 }
 
-void list_insert(list_t *list, int index, void *item) {
-	list_resize(list);
+int list_insert(list_t *list, int index, void *item) {
+	if (list_resize(list) < 0) {
+		return -ENOMEM;
+	}
 	memmove(&list->items[index + 1], &list->items[index], sizeof(void*) * (list->length - index));
 	list->length++;
 	list->items[index] = item;
+	return 0;
 }
 
 void list_del(list_t *list, int index) {
@@ -8,9 +8,10 @@ typedef struct {
 } list_t;
 
 list_t *create_list(void);
+list_t *create_list_with_capacity(int capacity);
 void list_free(list_t *list);
-void list_add(list_t *list, void *item);
-void list_insert(list_t *list, int index, void *item);
+int list_add(list_t *list, void *item);
+int list_insert(list_t *list, int index, void *item);
 void list_del(list_t *list, int index);
 int list_seq_find(list_t *list, int compare(const void *item, const void *cmp_to), const void *cmp_to);
 int list_find(list_t *list, const void *item);
@@ -1,18 +1,110 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "alert.h"
+#include "config.h"
 #include "dbus.h"
+#include "hook.h"
+#include "idmap.h"
+#include "notifier.h"
 #include "notify.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "record.h"
+#include "session.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "upower.h"
 #include "list.h"
 
-#define NOTIFICATION_MAX_LEN 128
+#define NOTIFICATION_MAX_LEN NOTIFY_SUMMARY_MAX_LEN
+
+// Routine alerts sent per loop iteration, and how long the rest wait
+#define ROUTINE_ALERT_BURST 4
+#define ROUTINE_ALERT_DEFER_MS 250
+
+// How long alerts that tend to come in bursts are gathered for, and room
+// for the devices listed in the resulting notification
+#define BATCH_WINDOW_MS 300
+#define NOTIFICATION_BATCH_MAX_LEN NOTIFIER_BODY_MAX_LEN
+
+// Default minimum time between progress updates of a device, and their
+// category
+#define PROGRESS_INTERVAL_MS 10000
+#define PROGRESS_CATEGORY "power.progress"
+
+// When saving power, how late timers may fire so that the kernel can
+// coalesce them with other wakeups, and how long deferred work waits
+// after the last bus activity
+#define POWER_SAVING_TIMER_SLACK_NS 50000000
+#define POWER_SAVING_DEFER_MS 30000
+
+// How often the wakeup count is reported
+#define WAKEUP_REPORT_INTERVAL_MS 3600000
+
+struct poweralertd {
+	struct upower state;
+	struct hooks hooks;
+	struct alert_queue queue;
+	struct alert_batches batches;
+
+	// Removed devices whose removal alert is already queued or batched
+	list_t *departing;
+	struct rate_limiter limiter;
+
+	// Cached enum notify_capability bits of the user bus server, -1 if
+	// unknown
+	int capabilities;
+
+	// Where the notification IDs of the user bus server are held
+	struct id_map ids;
+
+	// Percentage steps and minimum interval of progress updates, if enabled
+	int progress_step;
+	uint64_t progress_interval_ms;
+	sd_bus *user_bus;
+	sd_bus *system_bus;
+
+	// Set in multi-session mode, replacing user_bus
+	struct sessions *sessions;
+
+	// Set if notifications are sent from a thread of their own, which
+	// then owns the user bus
+	struct notifier *notifier;
+
+	struct config config;
+	bool ignore_initial;
+	bool initialized;
+
+	// Replays follow the clock of the recording, so that alerts are
+	// batched as they were live
+	bool replaying;
+	uint64_t replay_ms;
+
+	// Set to handle bus messages in batches and defer housekeeping, at
+	// the cost of some latency. deferred_ms is when deferred work is due,
+	// UINT64_MAX if there is none.
+	bool power_saving;
+	uint64_t deferred_ms;
+
+	// Wakeups from poll since wakeup_report_ms
+	uint64_t wakeups;
+	uint64_t wakeup_report_ms;
+
+	// Polled file descriptors, with room for every session bus
+	struct pollfd *pollfds;
+	size_t pollfds_cap;
+};
 
 static uint64_t milliseconds_since(struct timespec *start) {
 	struct timespec current;
@@ -23,132 +115,458 @@ static uint64_t milliseconds_since(struct timespec *start) {
 	return (current.tv_sec - start->tv_sec) * 1000 + (current.tv_nsec - start->tv_nsec) / 1000000;
 }
 
-static int send_remove(sd_bus *bus, struct upower_device *device) {
-	enum urgency urgency = URGENCY_NORMAL;
-	char title[NOTIFICATION_MAX_LEN];
-
-	if (strlen(device->model) > 0) {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s", device->model);
-	} else {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s (%s)", device->native_path, upower_device_type_string(device));
+static uint64_t now_ms(void) {
+	struct timespec current;
+	if (clock_gettime(CLOCK_MONOTONIC, &current) == -1) {
+		return 0;
 	}
-	char *msg = "Device disconnected\n";
-	char *category = "device.removed";
 
-	return notify(bus, title, msg, category, 0, urgency);
+	return (uint64_t)current.tv_sec * 1000 + current.tv_nsec / 1000000;
 }
 
-static int send_online_update(sd_bus *bus, struct upower_device *device) {
-	if (device->current.online == device->last.online) {
+static uint64_t alert_clock(struct poweralertd *ctx) {
+	return ctx->replaying ? ctx->replay_ms : now_ms();
+}
+
+// Fills in the pollfd for a bus and lowers deadline to its timeout, if any.
+static int bus_pollfd(sd_bus *bus, struct pollfd *pfd, uint64_t *deadline) {
+	if (bus == NULL) {
+		*pfd = (struct pollfd){ .fd = -1 };
 		return 0;
 	}
 
-	char title[NOTIFICATION_MAX_LEN];
-	char *msg;
+	int fd = sd_bus_get_fd(bus);
+	if (fd < 0) {
+		return fd;
+	}
+	int events = sd_bus_get_events(bus);
+	if (events < 0) {
+		return events;
+	}
+	uint64_t bus_timeout;
+	int ret = sd_bus_get_timeout(bus, &bus_timeout);
+	if (ret < 0) {
+		return ret;
+	}
 
-	if (strlen(device->model) > 0) {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s", device->model);
-	} else {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s (%s)", device->native_path, upower_device_type_string(device));
+	if (bus_timeout != UINT64_MAX && bus_timeout / 1000 < *deadline) {
+		*deadline = bus_timeout / 1000;
 	}
-	char *category;
-	if (device->current.online) {
-		msg = "Power supply online";
-		category = "power.online";
-	} else {
-		msg = "Power supply offline";
-		category = "power.offline";
+	*pfd = (struct pollfd){ .fd = fd, .events = events };
+	return 0;
+}
+
+// Waits for a bus, a hook, the config file or the notifier to need
+// attention. Hooks are only ever reaped from here, so a slow hook never
+// holds up event processing.
+static int wait_for_events(struct poweralertd *ctx) {
+	uint64_t deadline = hooks_next_deadline(&ctx->hooks);
+	int ret;
+
+	size_t nfds = 5;
+	if (ctx->sessions != NULL) {
+		nfds += ctx->sessions->buses->length;
 	}
+	if (nfds > ctx->pollfds_cap) {
+		struct pollfd *resized = realloc(ctx->pollfds, nfds * sizeof(struct pollfd));
+		if (resized == NULL) {
+			return -ENOMEM;
+		}
+		ctx->pollfds = resized;
+		ctx->pollfds_cap = nfds;
+	}
+	struct pollfd *fds = ctx->pollfds;
 
-	return notify(bus, title, msg, category, &device->notifications[SLOT_ONLINE], URGENCY_NORMAL);
+	ret = bus_pollfd(ctx->system_bus, &fds[0], &deadline);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = bus_pollfd(ctx->user_bus, &fds[1], &deadline);
+	if (ret < 0) {
+		return ret;
+	}
+	fds[2] = (struct pollfd){ .fd = ctx->hooks.fd, .events = POLLIN };
+	fds[3] = (struct pollfd){ .fd = ctx->config.fd, .events = POLLIN };
+	fds[4] = (struct pollfd){ .fd = ctx->notifier != NULL ? ctx->notifier->fd : -1, .events = POLLIN };
+	for (size_t idx = 5; idx < nfds; idx++) {
+		// A broken session bus is dropped by sessions_process() instead
+		struct session_bus *session = ctx->sessions->buses->items[idx - 5];
+		if (bus_pollfd(session->bus, &fds[idx], &deadline) < 0) {
+			fds[idx] = (struct pollfd){ .fd = -1 };
+			deadline = 0;
+		}
+	}
+
+	// A backed up notifier wakes us once it can take more
+	bool blocked = ctx->notifier != NULL && notifier_busy(ctx->notifier);
+	uint64_t now = now_ms();
+	if (!blocked && ctx->queue.length > 0 && now + ROUTINE_ALERT_DEFER_MS < deadline) {
+		deadline = now + ROUTINE_ALERT_DEFER_MS;
+	}
+	uint64_t batch_deadline = alert_batch_next_deadline(&ctx->batches);
+	if (!blocked && batch_deadline < deadline) {
+		deadline = batch_deadline;
+	}
+	uint64_t release_deadline = rate_limit_next_release(&ctx->limiter);
+	if (release_deadline < deadline) {
+		deadline = release_deadline;
+	}
+	if (ctx->deferred_ms < deadline) {
+		deadline = ctx->deferred_ms;
+	}
+
+	int timeout = -1;
+	if (deadline != UINT64_MAX) {
+		timeout = deadline > now ? (int)(deadline - now) : 0;
+	}
+
+	ret = poll(fds, nfds, timeout);
+	if (ret < 0 && errno != EINTR) {
+		return -errno;
+	}
+	ctx->wakeups++;
+
+	return hooks_process(&ctx->hooks);
 }
 
-static int send_state_update(sd_bus *bus, struct upower_device *device) {
-	if (device->current.state == device->last.state) {
-		return 0;
+// Notification IDs handed out by a previous notification daemon mean
+// nothing to its successor, so they are forgotten rather than replaced.
+static void forget_notifications(list_t *devices) {
+	for (int idx = 0; idx < devices->length; idx++) {
+		struct upower_device *device = devices->items[idx];
+		memset(device->notifications, 0, sizeof(device->notifications));
 	}
+}
 
-	enum urgency urgency;
-	char title[NOTIFICATION_MAX_LEN];
-	char msg[NOTIFICATION_MAX_LEN];
+static void forget_all_notifications(struct poweralertd *ctx) {
+	forget_notifications(ctx->state.devices);
+	forget_notifications(ctx->state.removed_devices);
+	id_map_clear(&ctx->ids);
+	ctx->state.dirty = true;
+}
 
-	switch (device->current.state) {
-	case UPOWER_DEVICE_STATE_UNKNOWN:
-		// Silence transitions to/from unknown
-		device->current.state = device->last.state;
-		return 0;
-	case UPOWER_DEVICE_STATE_EMPTY:
-		urgency = URGENCY_CRITICAL;
-		break;
-	default:
-		urgency = URGENCY_NORMAL;
-		break;
+static int handle_notifications_owner_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct poweralertd *ctx = userdata;
+	const char *name, *old_owner, *new_owner;
+	ctx->capabilities = -1;
+
+	// A daemon activated by our first notification has no predecessor,
+	// and the ID it just handed out is still good
+	if (sd_bus_message_read(msg, "sss", &name, &old_owner, &new_owner) > 0 && old_owner[0] != '\0') {
+		forget_all_notifications(ctx);
 	}
+	return 0;
+}
 
-	if (strlen(device->model) > 0) {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s", device->model);
-	} else {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %s (%s)", device->native_path, upower_device_type_string(device));
+static int handle_notification_closed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct poweralertd *ctx = userdata;
+	uint32_t id;
+	if (sd_bus_message_read(msg, "u", &id) > 0) {
+		id_map_close(&ctx->ids, id);
+		ctx->state.dirty = true;
 	}
-	if (device->current.battery_level != UPOWER_DEVICE_LEVEL_NONE) {
-		snprintf(msg, NOTIFICATION_MAX_LEN, "Battery %s\nCurrent level: %s\n", upower_device_state_string(device), upower_device_battery_level_string(device));
-	} else {
-		snprintf(msg, NOTIFICATION_MAX_LEN, "Battery %s\nCurrent level: %0.0lf%%\n", upower_device_state_string(device), device->current.percentage);
+	return 0;
+}
+
+// Indexes the IDs restored from a snapshot
+static void index_notifications(struct poweralertd *ctx) {
+	for (int idx = 0; idx < ctx->state.devices->length; idx++) {
+		struct upower_device *device = ctx->state.devices->items[idx];
+		for (int slot = 0; slot < 3; slot++) {
+			id_map_update(&ctx->ids, &device->notifications[slot], 0);
+		}
 	}
+}
 
-	return notify(bus, title, msg, "power.update", &device->notifications[SLOT_STATE], urgency);
+static void forget_device_notifications(struct poweralertd *ctx, struct upower_device *device) {
+	for (int slot = 0; slot < 3; slot++) {
+		id_map_take(&ctx->ids, device->notifications[slot]);
+	}
 }
 
-static int send_warning_update(sd_bus *bus, struct upower_device *device) {
-	if (device->current.warning_level == device->last.warning_level) {
-		return 0;
+// Hands a notification to the notifier thread. The ID it ends up with comes
+// back through process_notifier_replies().
+static int deliver_threaded(struct poweralertd *ctx, struct upower_device *device, int slot,
+		const char *title, const char *msg, const char *category, enum urgency urgency, int value) {
+	struct notifier_request request = {
+		.slot = slot,
+		.id = slot >= 0 ? device->notifications[slot] : 0,
+		.urgency = urgency,
+		.value = value,
+	};
+	if (device != NULL) {
+		snprintf(request.path, sizeof(request.path), "%s", device->path);
 	}
+	snprintf(request.summary, sizeof(request.summary), "%s", title);
+	snprintf(request.body, sizeof(request.body), "%s", msg);
+	snprintf(request.category, sizeof(request.category), "%s", category);
 
-	if (device->current.warning_level == UPOWER_DEVICE_LEVEL_NONE && device->last.warning_level == UPOWER_DEVICE_LEVEL_UNKNOWN) {
-		return 0;
+	if (notifier_send(ctx->notifier, &request) < 0) {
+		// The notification daemon is not keeping up, and this would only
+		// add to what it already has to show
+		fprintf(stderr, "dropped %s notification, notifier backed up\n", category);
+	}
+	return 0;
+}
+
+static struct upower_device *find_device(list_t *devices, const char *path) {
+	for (int idx = 0; idx < devices->length; idx++) {
+		struct upower_device *device = devices->items[idx];
+		if (strcmp(device->path, path) == 0) {
+			return device;
+		}
+	}
+	return NULL;
+}
+
+static void process_notifier_replies(struct poweralertd *ctx) {
+	struct notifier_reply reply;
+	while (notifier_reply(ctx->notifier, &reply)) {
+		if (reply.closed) {
+			id_map_close(&ctx->ids, reply.id);
+			ctx->state.dirty = true;
+			continue;
+		}
+		if (reply.path[0] == '\0') {
+			forget_all_notifications(ctx);
+			continue;
+		}
+		struct upower_device *device = find_device(ctx->state.devices, reply.path);
+		if (device == NULL) {
+			device = find_device(ctx->state.removed_devices, reply.path);
+		}
+		if (device != NULL) {
+			uint32_t previous = device->notifications[reply.slot];
+			device->notifications[reply.slot] = reply.id;
+			id_map_update(&ctx->ids, &device->notifications[reply.slot], previous);
+			ctx->state.dirty |= reply.id != previous;
+		}
+	}
+}
+
+// Whether a notification can be sent right away. With the notifier thread
+// backed up, alerts wait in the queue or their batch meanwhile, where they
+// are still replaced by newer ones. Replays wait for it instead, so that
+// what is sent does not depend on how fast it is sent.
+static bool notifier_ready(struct poweralertd *ctx) {
+	if (ctx->notifier == NULL) {
+		return true;
+	}
+	while (ctx->replaying && notifier_busy(ctx->notifier)) {
+		struct pollfd fd = { .fd = ctx->notifier->fd, .events = POLLIN };
+		poll(&fd, 1, -1);
+		process_notifier_replies(ctx);
+	}
+	return !notifier_busy(ctx->notifier);
+}
+
+// Sends a notification either to our own session, or to every graphical
+// session in multi-session mode. A missing or restarting notification
+// daemon must not take us down, so such failures are only logged.
+static int deliver(struct poweralertd *ctx, struct upower_device *device, int slot,
+		const char *title, const char *msg, const char *category, enum urgency urgency, int value) {
+	if (ctx->notifier != NULL) {
+		return deliver_threaded(ctx, device, slot, title, msg, category, urgency, value);
+	}
+	if (ctx->sessions == NULL) {
+		uint32_t *id = slot >= 0 ? &device->notifications[slot] : NULL;
+		uint32_t previous = id != NULL ? *id : 0;
+		int ret = notify_adapted(ctx->user_bus, &ctx->capabilities, title, msg, category, id, urgency, value);
+		if (id != NULL) {
+			id_map_update(&ctx->ids, id, previous);
+			ctx->state.dirty |= *id != previous;
+		}
+		if (ret < 0 && ret != -ENOMEM && ctx->user_bus != NULL) {
+			// Most likely the notification daemon is restarting
+			fprintf(stderr, "could not send %s notification: %s\n", category, strerror(-ret));
+			return 0;
+		}
+		return ret;
+	}
+
+	for (int idx = 0; idx < ctx->sessions->buses->length; idx++) {
+		struct session_bus *session = ctx->sessions->buses->items[idx];
+		uint32_t *id = NULL;
+		if (slot >= 0) {
+			// Progress is only shown where the state notification still is
+			if (strcmp(category, PROGRESS_CATEGORY) == 0 &&
+					session_notification_id(session, device, slot) == 0) {
+				continue;
+			}
+			id = session_notification_slot(session, device, slot);
+			if (id == NULL) {
+				return -ENOMEM;
+			}
+		}
+		uint32_t previous = id != NULL ? *id : 0;
+		int ret = notify_adapted(session->bus, &session->capabilities, title, msg, category, id, urgency, value);
+		if (id != NULL) {
+			id_map_update(&session->ids, id, previous);
+		}
+		if (ret < 0) {
+			fprintf(stderr, "could not notify session of uid %u: %s\n", (unsigned)session->uid, strerror(-ret));
+		}
+	}
+	return 0;
+}
+
+static int device_percentage(struct upower_device *device) {
+	return (int)(device->current.percentage + 0.5);
+}
+
+static void device_name(struct upower_device *device, char *name, size_t len) {
+	if (strlen(device->model) > 0) {
+		snprintf(name, len, "%s", device->model);
+	} else if (strlen(device->native_path) == 0) {
+		// Composite devices such as the DisplayDevice only have a type
+		snprintf(name, len, "%s", upower_device_type_string(device));
+	} else {
+		snprintf(name, len, "%s (%s)", device->native_path, upower_device_type_string(device));
+	}
+}
+
+// Appends the extended properties the policy of a device asks for
+static void append_details(struct upower_device *device, uint32_t mask, char *msg, size_t len) {
+	const struct upower_device_props *props = &device->current;
+	size_t used = strlen(msg);
+
+	if ((mask & UPOWER_DEVICE_PROP_TEMPERATURE) && used < len) {
+		used += snprintf(msg + used, len - used, "Temperature: %.1lf °C\n", props->temperature);
+	}
+	if ((mask & UPOWER_DEVICE_PROP_CAPACITY) && used < len) {
+		used += snprintf(msg + used, len - used, "Capacity: %.0lf%%\n", props->capacity);
+	}
+	if ((mask & UPOWER_DEVICE_PROP_ENERGY_RATE) && props->energy_rate > 0 && used < len) {
+		used += snprintf(msg + used, len - used, "Energy rate: %.1lf W\n", props->energy_rate);
+	}
+	if ((mask & UPOWER_DEVICE_PROP_TIME_TO_EMPTY) && props->time_to_empty > 0 && used < len) {
+		used += snprintf(msg + used, len - used, "Time to empty: %d:%02d\n",
+			(int)(props->time_to_empty / 3600), (int)(props->time_to_empty / 60 % 60));
+	}
+	if ((mask & UPOWER_DEVICE_PROP_TIME_TO_FULL) && props->time_to_full > 0 && used < len) {
+		snprintf(msg + used, len - used, "Time to full: %d:%02d\n",
+			(int)(props->time_to_full / 3600), (int)(props->time_to_full / 60 % 60));
 	}
+}
 
-	enum urgency urgency = URGENCY_CRITICAL;
+static int send_alert(struct poweralertd *ctx, struct upower_device *device,
+		const struct alert_action *action, uint32_t suppressed) {
 	char title[NOTIFICATION_MAX_LEN];
-	char *msg;
-	char *category;
-
-	switch (device->current.warning_level) {
-	case UPOWER_DEVICE_LEVEL_NONE:
-		msg = "Warning cleared\n";
-		urgency = URGENCY_NORMAL;
-		category = "power.cleared";
-		break;
-	case UPOWER_DEVICE_LEVEL_DISCHARGING:
-		msg = "Warning: system discharging\n";
-		category = "power.discharging";
+	char msg[NOTIFICATION_MAX_LEN];
+	const char *prefix = action->kind == ALERT_WARNING || action->kind == ALERT_HEALTH ?
+		"Power warning" : "Power status";
+	int slot = -1;
+	int value = -1;
+
+	int len = snprintf(title, NOTIFICATION_MAX_LEN, "%s: ", prefix);
+	device_name(device, title + len, NOTIFICATION_MAX_LEN - len);
+
+	switch (action->kind) {
+	case ALERT_STATE:
+		if (device->current.battery_level != UPOWER_DEVICE_LEVEL_NONE) {
+			snprintf(msg, NOTIFICATION_MAX_LEN, "Battery %s\nCurrent level: %s\n", upower_device_state_string(device), upower_device_battery_level_string(device));
+		} else {
+			snprintf(msg, NOTIFICATION_MAX_LEN, "Battery %s\nCurrent level: %0.0lf%%\n", upower_device_state_string(device), device->current.percentage);
+			if (ctx->progress_step > 0) {
+				value = device_percentage(device);
+				device->progress = value - value % ctx->progress_step;
+				device->progress_ms = alert_clock(ctx);
+			}
+		}
+		if (device->policy.details) {
+			append_details(device, device->policy.props & (UPOWER_DEVICE_PROP_ENERGY_RATE |
+				UPOWER_DEVICE_PROP_TIME_TO_EMPTY | UPOWER_DEVICE_PROP_TIME_TO_FULL),
+				msg, NOTIFICATION_MAX_LEN);
+		}
+		slot = SLOT_STATE;
 		break;
-	case UPOWER_DEVICE_LEVEL_LOW:
-		msg = "Warning: power level low\n";
-		category = "power.low";
+	case ALERT_WARNING:
+		snprintf(msg, NOTIFICATION_MAX_LEN, "%s", action->message);
+		slot = SLOT_WARNING;
 		break;
-	case UPOWER_DEVICE_LEVEL_CRITICAL:
-		msg = "Warning: power level critical\n";
-		urgency = URGENCY_CRITICAL;
-		category = "power.critical";
+	case ALERT_ONLINE:
+		snprintf(msg, NOTIFICATION_MAX_LEN, "%s", action->message);
+		slot = SLOT_ONLINE;
 		break;
-	case UPOWER_DEVICE_LEVEL_ACTION:
-		msg = "Warning: power level at action threshold\n";
-		category = "power.action";
+	case ALERT_REMOVED:
+		snprintf(msg, NOTIFICATION_MAX_LEN, "%s", action->message);
 		break;
-	default:
-		msg = "Warning: unknown warning level\n";
-		category = "power.unknown";
+	case ALERT_HEALTH:
+		snprintf(msg, NOTIFICATION_MAX_LEN, "%s", action->message);
+		append_details(device, device->policy.props &
+			(UPOWER_DEVICE_PROP_TEMPERATURE | UPOWER_DEVICE_PROP_CAPACITY),
+			msg, NOTIFICATION_MAX_LEN);
 		break;
 	}
 
-	if (strlen(device->model) > 0) {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power warning: %s", device->model);
-	} else {
-		snprintf(title, NOTIFICATION_MAX_LEN, "Power warning: %s (%s)", device->native_path, upower_device_type_string(device));
+	if (suppressed > 0) {
+		size_t len = strlen(msg);
+		snprintf(msg + len, NOTIFICATION_MAX_LEN - len, "(%u similar notifications suppressed)",
+			(unsigned)suppressed);
 	}
 
-	return notify(bus, title, msg, category, &device->notifications[SLOT_WARNING], urgency);
+	int ret = hooks_run(&ctx->hooks, action->category, device);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return deliver(ctx, device, slot, title, msg, action->category, action->urgency, value);
+}
+
+// Sends one notification listing every device of a batch. Hooks still run
+// once per device, as they are given the details of a single device.
+static int send_batch(struct poweralertd *ctx, struct alert_batch *batch) {
+	char title[NOTIFICATION_MAX_LEN];
+	char msg[NOTIFICATION_BATCH_MAX_LEN];
+	const char *message = batch->action.message;
+
+	snprintf(title, NOTIFICATION_MAX_LEN, "Power status: %d devices", batch->length);
+	size_t len = snprintf(msg, sizeof(msg), "%.*s:", (int)strcspn(message, "\n"), message);
+
+	for (int idx = 0; idx < batch->length; idx++) {
+		struct upower_device *device = batch->devices[idx];
+		int ret = hooks_run(&ctx->hooks, batch->action.category, device);
+		if (ret < 0) {
+			return ret;
+		}
+		if (len + 2 < sizeof(msg)) {
+			len += snprintf(msg + len, sizeof(msg) - len, "%s ", idx > 0 ? "," : "");
+			device_name(device, msg + len, sizeof(msg) - len);
+			len += strlen(msg + len);
+		}
+	}
+
+	return deliver(ctx, NULL, -1, title, msg, batch->action.category, batch->action.urgency, -1);
+}
+
+// Processes messages received on a bus, one at a time or, when saving
+// power, all of them so that a burst of signals costs a single pass over
+// the devices. Returns 1 if anything was processed.
+static int process_bus(sd_bus *bus, bool drain) {
+	int processed = 0;
+	int ret;
+	while ((ret = sd_bus_process(bus, NULL)) > 0) {
+		processed = 1;
+		if (!drain) {
+			break;
+		}
+	}
+	return ret < 0 ? ret : processed;
+}
+
+// Reports the wakeup count once its interval is over. This is only ever
+// checked when awake anyway, so it never causes a wakeup of its own.
+static void report_wakeups(struct poweralertd *ctx) {
+	uint64_t now = now_ms();
+	uint64_t elapsed = now - ctx->wakeup_report_ms;
+	if (elapsed < WAKEUP_REPORT_INTERVAL_MS) {
+		return;
+	}
+	fprintf(stderr, "%lu wakeups in %lu minutes (%.1f per hour)\n",
+		(unsigned long)ctx->wakeups, (unsigned long)(elapsed / 60000),
+		ctx->wakeups * 3600000.0 / elapsed);
+	ctx->wakeups = 0;
+	ctx->wakeup_report_ms = now;
 }
 
 static const char usage[] = "usage: %s [options]\n"
@@ -156,16 +574,502 @@ static const char usage[] = "usage: %s [options]\n"
 "  -v				show the version number\n"
 "  -s				ignore the events at startup\n"
 "  -i <device_type>		ignore this device type, can be use several times\n"
-"  -S				only use the events coming from power supplies\n";
+"  -S				only use the events coming from power supplies\n"
+"  -c <file>			read rules from file instead of\n"
+"				$XDG_CONFIG_HOME/poweralertd/config\n"
+"  -e <category>=<command>	run command when a notification of this category\n"
+"				is sent, can be used several times\n"
+"  -j <count>			maximum number of hooks running at once\n"
+"  -t <seconds>			kill hooks still running after this long, or never\n"
+"				if 0 (default 30)\n"
+"  -r <file>			record all UPower signals to file\n"
+"  -R <file>			replay recorded signals instead of using the bus\n"
+"  -W				replay in real time instead of at full speed\n"
+"  -M				notify every graphical session on the system\n"
+"  -A <address>			session bus address for -M, %%u is replaced by\n"
+"				the uid (default unix:path=/run/user/%%u/bus)\n"
+"  -n				do not keep a state snapshot across restarts\n"
+"  -p <percent>			update the state notification of charging devices\n"
+"				in place, in steps of percent\n"
+"  -P <seconds>			minimum time between such updates (default 10)\n"
+"  -D				follow the combined state of the laptop batteries\n"
+"				rather than each of them\n"
+"  -N				send notifications from a separate thread\n"
+"  -w				save power by handling events in batches and\n"
+"				deferring housekeeping, at the cost of latency\n"
+"  -T				print when each event reaches each stage up to\n"
+"				its notification\n";
+
+// Parses a duration given on the command line in whole seconds
+static int parse_seconds(const char *arg, uint64_t *ms) {
+	char *end;
+	errno = 0;
+	long parsed = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno != 0 || parsed < 0 || parsed > INT_MAX) {
+		return -EINVAL;
+	}
+	*ms = (uint64_t)parsed * 1000;
+	return 0;
+}
+
+// Parses a count given on the command line, which must be at least min
+static int parse_count(const char *arg, int min, int *count) {
+	char *end;
+	errno = 0;
+	long parsed = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno != 0 || parsed < min || parsed > INT_MAX) {
+		return -EINVAL;
+	}
+	*count = parsed;
+	return 0;
+}
+
+static void device_policy(struct upower_device *device, struct upower_device_policy *policy, void *data) {
+	struct poweralertd *ctx = data;
+	config_device_policy(&ctx->config, device, policy);
+}
+
+// Sends pending alerts, most important first. Only a burst of routine
+// alerts goes out at a time, so a backlog of peripheral updates can neither
+// hold up a critical alert arriving meanwhile nor flood the notification
+// daemon. The rest wait for the next iteration, and are replaced if their
+// device changes again meanwhile.
+static int dispatch_alerts(struct poweralertd *ctx, bool all) {
+	struct queued_alert alert;
+	int routine = 0;
+
+	const struct queued_alert *next;
+	while ((next = alert_queue_peek(&ctx->queue)) != NULL) {
+		if (!all && next->priority == ALERT_PRIORITY_ROUTINE && routine++ == ROUTINE_ALERT_BURST) {
+			break;
+		}
+		if (!notifier_ready(ctx)) {
+			break;
+		}
+		alert_queue_pop(&ctx->queue, &alert);
+
+		int ret = send_alert(ctx, alert.device, &alert.action, alert.suppressed);
+		if (ret < 0) {
+			fprintf(stderr, "could not send %s notification: %s\n", alert.action.category, strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+// Sends batches whose window has passed, or all of them. A batch of one is
+// sent as the alert it would have been without batching.
+static int flush_batches(struct poweralertd *ctx, bool all) {
+	uint64_t now = alert_clock(ctx);
+
+	for (int idx = 0; idx < ALERT_BATCHES; idx++) {
+		struct alert_batch *batch = &ctx->batches.items[idx];
+		if (batch->length == 0 || (!all && now < batch->deadline)) {
+			continue;
+		}
+
+		if (batch->action.kind == ALERT_REMOVED) {
+			// Devices that came back meanwhile were not removed after all
+			for (int dev = batch->length - 1; dev >= 0; dev--) {
+				struct upower_device *device = batch->devices[dev];
+				if (list_find(ctx->state.removed_devices, device) == -1) {
+					alert_batch_remove(batch, device);
+				}
+			}
+		}
+
+		if (!notifier_ready(ctx)) {
+			break;
+		}
+		int ret = 0;
+		if (batch->length == 1) {
+			ret = send_alert(ctx, batch->devices[0], &batch->action, 0);
+		} else if (batch->length > 1) {
+			ret = send_batch(ctx, batch);
+		}
+		batch->length = 0;
+		if (ret < 0) {
+			fprintf(stderr, "could not send %s notification: %s\n", batch->action.category, strerror(-ret));
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void queue_alert(struct poweralertd *ctx, struct upower_device *device,
+		const struct alert_action *action, uint32_t suppressed) {
+	// Batches list devices, with no room for what was suppressed
+	if (alert_batchable(action) && suppressed == 0) {
+		if (alert_batch_add(&ctx->batches, device, action, alert_clock(ctx) + BATCH_WINDOW_MS)) {
+			return;
+		}
+		if (action->kind == ALERT_REMOVED) {
+			// Sent on its own, so nothing is left to hold on to the device for
+			alert_batch_forget_device(&ctx->batches, device);
+		}
+	}
+	if (!alert_queue_push(&ctx->queue, device, action, suppressed)) {
+		fprintf(stderr, "dropped %s notification, too many pending\n", action->category);
+	}
+}
+
+static const struct alert_action progress_action = {
+	ALERT_STATE, URGENCY_LOW, PROGRESS_CATEGORY, NULL,
+};
+
+// Whether a state notification of the device is still shown anywhere.
+// Progress only ever updates one, rather than opening a new one once it
+// was dismissed or expired.
+static bool has_state_notification(struct poweralertd *ctx, struct upower_device *device) {
+	if (ctx->sessions == NULL) {
+		return device->notifications[SLOT_STATE] != 0;
+	}
+	for (int idx = 0; idx < ctx->sessions->buses->length; idx++) {
+		if (session_notification_id(ctx->sessions->buses->items[idx], device, SLOT_STATE) != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Updates the state notification of a charging device in place as its
+// percentage crosses a step, at most once per interval however often UPower
+// reports a new percentage.
+static void queue_progress(struct poweralertd *ctx, struct upower_device *device) {
+	if (device->current.state != UPOWER_DEVICE_STATE_CHARGING ||
+			device->current.battery_level != UPOWER_DEVICE_LEVEL_NONE ||
+			!upower_device_has_battery(device) || !has_state_notification(ctx, device)) {
+		return;
+	}
+
+	int value = device_percentage(device);
+	int step = value - value % ctx->progress_step;
+	uint64_t now = alert_clock(ctx);
+	if (step == device->progress || now - device->progress_ms < ctx->progress_interval_ms) {
+		return;
+	}
+	device->progress = step;
+	device->progress_ms = now;
+	queue_alert(ctx, device, &progress_action, 0);
+}
+
+// Queues an alert unless its device has caused too many of the same
+// category lately. Critical alerts are never held back.
+static void collect_alert(struct poweralertd *ctx, struct upower_device *device, const struct alert_action *action) {
+	TRACE(decide, TRACE_DECIDE, device->path, action->category);
+	if (action->urgency != URGENCY_CRITICAL) {
+		int count, period;
+		config_rate_limit(&ctx->config, action->category, &count, &period);
+		if (!rate_limit_take(&ctx->limiter, device, action, count, (uint64_t)period * 1000, alert_clock(ctx))) {
+			return;
+		}
+	}
+	queue_alert(ctx, device, action, 0);
+}
+
+// Once a rate limited device has calmed down, the latest of the alerts it
+// was denied stands in for all of them
+static void release_alerts(struct poweralertd *ctx) {
+	struct upower_device *limited;
+	struct alert_action released;
+	uint32_t suppressed;
+	while (rate_limit_release(&ctx->limiter, alert_clock(ctx), &limited, &released, &suppressed)) {
+		// Buckets of the same device release in no particular order, so
+		// only what matches the device now, as last evaluated, stands
+		struct alert_action action;
+		if (alert_refresh(&released, &limited->last, limited->policy.worn, &action)) {
+			queue_alert(ctx, limited, &action, suppressed);
+		}
+	}
+}
+
+static int process_devices(struct poweralertd *ctx) {
+	struct upower *state = &ctx->state;
+	int ret;
+
+	// Batches due are sent before anything else, or a device changing back
+	// after the window would be taken as never having changed at all
+	ret = flush_batches(ctx, false);
+	if (ret < 0) {
+		return ret;
+	}
+
+	for (int idx = 0; idx < state->devices->length; idx++) {
+		struct upower_device *device = state->devices->items[idx];
+		struct upower_device_props current = alert_apply_thresholds(&device->current,
+			device->policy.low, device->policy.critical);
+
+		if (device->policy.ignored) {
+			goto next_device;
+		}
+
+		if (!ctx->initialized && ctx->ignore_initial) {
+			goto next_device;
+		}
+
+		struct alert_action actions[ALERT_MAX_ACTIONS];
+		int count = alert_evaluate(&device->last, &current, upower_device_has_battery(device), actions);
+		for (int action = 0; action < count; action++) {
+			collect_alert(ctx, device, &actions[action]);
+		}
+		if (count == 0 && ctx->progress_step > 0) {
+			queue_progress(ctx, device);
+		}
+
+		if (upower_device_has_battery(device) && (device->policy.props &
+				(UPOWER_DEVICE_PROP_TEMPERATURE | UPOWER_DEVICE_PROP_CAPACITY))) {
+			count = alert_evaluate_health(&device->last, &current,
+				device->policy.hot, device->policy.worn, actions);
+			for (int action = 0; action < count; action++) {
+				collect_alert(ctx, device, &actions[action]);
+			}
+		}
+next_device:
+		current = alert_next_last(&device->last, &current);
+		current.temperature = alert_next_temperature(device->last.temperature,
+			current.temperature, device->policy.hot);
+		state->dirty |= snapshot_props_differ(&device->last, &current);
+		device->last = current;
+	}
+
+	// Devices waiting for their batch stay among the removed ones, but are
+	// only reported once, and again if they come back and leave again
+	for (int idx = 0; idx < ctx->departing->length; idx++) {
+		if (list_find(state->removed_devices, ctx->departing->items[idx]) == -1) {
+			list_del(ctx->departing, idx--);
+		}
+	}
+	for (int idx = 0; idx < state->removed_devices->length; idx++) {
+		struct upower_device *device = state->removed_devices->items[idx];
+		if (list_find(ctx->departing, device) != -1) {
+			continue;
+		}
+		list_add(ctx->departing, device);
+		if (!device->policy.ignored) {
+			collect_alert(ctx, device, alert_removed());
+		}
+	}
+
+	release_alerts(ctx);
 
+	ret = dispatch_alerts(ctx, false);
+	if (ret < 0) {
+		return ret;
+	}
+
+	// Removals are never routine, so those not waiting in a batch are all
+	// sent by now, unless the notifier is backed up
+	for (int idx = 0; idx < state->removed_devices->length; idx++) {
+		struct upower_device *device = state->removed_devices->items[idx];
+		if (alert_batch_contains(&ctx->batches, device) ||
+				alert_queue_contains(&ctx->queue, device, ALERT_REMOVED)) {
+			continue;
+		}
+		int departing = list_find(ctx->departing, device);
+		if (departing != -1) {
+			list_del(ctx->departing, departing);
+		}
+		alert_queue_forget_device(&ctx->queue, device);
+		rate_limit_forget_device(&ctx->limiter, device);
+		forget_device_notifications(ctx, device);
+		if (ctx->sessions != NULL) {
+			sessions_forget_device(ctx->sessions, device);
+		}
+		upower_device_destroy(device);
+		list_del(state->removed_devices, idx--);
+	}
+
+	return 0;
+}
+
+// The next time anything held back is due during a replay
+static uint64_t replay_next_due(struct poweralertd *ctx) {
+	uint64_t due = alert_batch_next_deadline(&ctx->batches);
+	uint64_t release = rate_limit_next_release(&ctx->limiter);
+	if (release < due) {
+		due = release;
+	}
+	if (ctx->queue.length > 0 && ctx->replay_ms + ROUTINE_ALERT_DEFER_MS < due) {
+		due = ctx->replay_ms + ROUTINE_ALERT_DEFER_MS;
+	}
+	return due;
+}
+
+// Sends whatever falls due before ms of the recording, as the poll deadline
+// would have had it sent live. Done before each event is applied, or a
+// device coming back would undo its removal from a batch already due.
+static int replay_until(struct poweralertd *ctx, uint64_t ms) {
+	uint64_t due;
+	while ((due = replay_next_due(ctx)) <= ms) {
+		if (due > ctx->replay_ms) {
+			ctx->replay_ms = due;
+		}
+		int ret = flush_batches(ctx, false);
+		if (ret < 0) {
+			return ret;
+		}
+		release_alerts(ctx);
+		ret = dispatch_alerts(ctx, false);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	ctx->replay_ms = ms;
+	return 0;
+}
+
+static int replay(struct poweralertd *ctx, const char *path, bool realtime) {
+	struct replayer replayer = { 0 };
+	struct record_event event;
+	struct timespec start;
+	uint64_t events = 0;
+	int ret;
+
+	ret = upower_create_lists(&ctx->state);
+	if (ret < 0) {
+		return ret;
+	}
+	ctx->state.policy = device_policy;
+	ctx->state.policy_data = ctx;
+	ctx->replaying = true;
+
+	ret = replayer_open(&replayer, path);
+	if (ret < 0) {
+		fprintf(stderr, "could not open recording %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
+		ret = -errno;
+		goto finish;
+	}
+
+	while ((ret = replayer_read(&replayer, &event)) > 0) {
+		if (realtime) {
+			uint64_t target = event.timestamp_us / 1000;
+			uint64_t elapsed;
+			while ((elapsed = milliseconds_since(&start)) < target) {
+				ret = replay_until(ctx, elapsed);
+				if (ret < 0) {
+					goto finish;
+				}
+				uint64_t wake = replay_next_due(ctx);
+				if (wake > target) {
+					wake = target;
+				}
+				struct pollfd fd = { .fd = ctx->hooks.fd, .events = POLLIN };
+				poll(&fd, 1, wake > elapsed ? wake - elapsed : 0);
+				ret = hooks_process(&ctx->hooks);
+				if (ret < 0) {
+					goto finish;
+				}
+			}
+		}
+
+		ret = replay_until(ctx, event.timestamp_us / 1000);
+		if (ret < 0) {
+			goto finish;
+		}
+
+		TRACE(receive, TRACE_RECEIVE, event.path, NULL);
+		ret = replayer_apply(&ctx->state, &event);
+		if (ret < 0) {
+			goto finish;
+		}
+		TRACE(decode, TRACE_DECODE, event.path, NULL);
+
+		ctx->initialized = event.timestamp_us > 500000;
+		ctx->replay_ms = event.timestamp_us / 1000;
+
+		if (ctx->notifier != NULL) {
+			process_notifier_replies(ctx);
+		}
+		ret = process_devices(ctx);
+		if (ret < 0) {
+			goto finish;
+		}
+
+		ret = hooks_process(&ctx->hooks);
+		if (ret < 0) {
+			goto finish;
+		}
+		events++;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "could not read recording %s: %s\n", path, strerror(-ret));
+		goto finish;
+	}
+
+	// Whatever is still held back is due by the end of the recording
+	ctx->replay_ms = UINT64_MAX / 2;
+	ret = process_devices(ctx);
+	if (ret < 0) {
+		goto finish;
+	}
+	ret = dispatch_alerts(ctx, true);
+	if (ret < 0) {
+		goto finish;
+	}
+	ret = flush_batches(ctx, true);
+	if (ret < 0) {
+		goto finish;
+	}
+	if (ctx->notifier != NULL) {
+		// Counts the time taken to send everything handed over
+		notifier_stop(ctx->notifier);
+	}
+
+	uint64_t elapsed = milliseconds_since(&start);
+	fprintf(stderr, "replayed %lu events in %lu ms (%.0f events/s)\n",
+		(unsigned long)events, (unsigned long)elapsed,
+		elapsed > 0 ? events * 1000.0 / elapsed : 0.0);
+	fprintf(stderr, "suppressed %lu notifications\n", (unsigned long)ctx->limiter.suppressed);
+
+finish:
+	replayer_close(&replayer);
+	return ret;
+}
 
 int main(int argc, char *argv[]) {
 	int opt = 0;
-	int device_type = 0;
-	int ignore_types_mask = 0;
-	bool ignore_initial = false;
-	bool ignore_non_power_supplies = false;
-	bool initialized = false;
+	char *config_path = NULL;
+	char rule[128];
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	bool replay_realtime = false;
+	struct poweralertd ctx = { 0 };
+	struct recorder recorder = { 0 };
+	struct sessions sessions = { 0 };
+	struct snapshot snapshot = { 0 };
+	struct notifier notifier = { 0 };
+	bool use_snapshot = true;
+	bool multi_session = false;
+	bool threaded = false;
+	int ret;
+
+	hooks_init(&ctx.hooks);
+	config_init(&ctx.config);
+	ctx.capabilities = -1;
+	ctx.progress_interval_ms = PROGRESS_INTERVAL_MS;
+	ctx.deferred_ms = UINT64_MAX;
+	ctx.wakeup_report_ms = now_ms();
+	rate_limiter_init(&ctx.limiter);
+
+	// With a device pool, what grows with the devices is sized for a full
+	// pool up front: the devices leaving, and the IDs of the notifications
+	// held in their slots
+#ifdef POWERALERTD_DEVICE_POOL
+	ctx.departing = create_list_with_capacity(POWERALERTD_DEVICE_POOL);
+	ret = id_map_reserve(&ctx.ids, POWERALERTD_DEVICE_POOL * 3);
+#else
+	ctx.departing = create_list();
+	ret = 0;
+#endif
+	if (ctx.departing == NULL || ctx.limiter.buckets == NULL || ret < 0) {
+		fprintf(stderr, "could not set up alert tracking: %s\n", strerror(ENOMEM));
+		return EXIT_FAILURE;
+	}
 
 	struct timespec start;
 	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
@@ -173,22 +1077,85 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 
-	while ((opt = getopt(argc, argv, "hvsi:S")) != -1) {
+	while ((opt = getopt(argc, argv, "hvsi:Sc:e:j:t:r:R:WMA:np:P:DNTw")) != -1) {
 		switch (opt) {
-		case 'i':
-			device_type = upower_device_type_int(optarg);
-			if (device_type > -1) {
-				ignore_types_mask |= 1 << device_type;
+		case 'e':
+			ret = hooks_add(&ctx.hooks, optarg);
+			if (ret < 0) {
+				fprintf(stderr, "could not add hook %s: %s\n", optarg, strerror(-ret));
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			if (parse_count(optarg, 1, &ctx.hooks.max_running) < 0) {
+				fprintf(stderr, "invalid hook count: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if (parse_seconds(optarg, &ctx.hooks.timeout_ms) < 0) {
+				fprintf(stderr, "invalid hook timeout: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'W':
+			replay_realtime = true;
+			break;
+		case 'M':
+			multi_session = true;
+			break;
+		case 'n':
+			use_snapshot = false;
+			break;
+		case 'p':
+			ctx.progress_step = atoi(optarg);
+			if (ctx.progress_step < 1 || ctx.progress_step > 100) {
+				fprintf(stderr, "invalid progress step: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'P':
+			if (parse_seconds(optarg, &ctx.progress_interval_ms) < 0) {
+				fprintf(stderr, "invalid progress interval: %s\n", optarg);
+				return EXIT_FAILURE;
 			}
-			else {
+			break;
+		case 'D':
+			ctx.state.display_device = true;
+			break;
+		case 'N':
+			threaded = true;
+			break;
+		case 'T':
+			trace_enabled = true;
+			break;
+		case 'w':
+			ctx.power_saving = true;
+			break;
+		case 'A':
+			free(sessions.address);
+			sessions.address = strdup(optarg);
+			break;
+		case 'i':
+			snprintf(rule, sizeof(rule), "ignore type %s", optarg);
+			if (upower_device_type_int(optarg) < 0 || config_add_line(&ctx.config, rule) < 0) {
 				printf("Unrecognized device type: %s\n", optarg);
 			}
 			break;
 		case 's':
-			ignore_initial = true;
+			ctx.ignore_initial = true;
 			break;
 		case 'S':
-			ignore_non_power_supplies = true;
+			config_add_line(&ctx.config, "ignore non-power-supply");
+			break;
+		case 'c':
+			config_path = optarg;
 			break;
 		case 'v':
 			printf("poweralertd version %s\n", POWERALERTD_VERSION);
@@ -200,112 +1167,204 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	struct upower state = { 0 };
-	sd_bus *user_bus = NULL;
-	sd_bus *system_bus = NULL;
-	int ret;
+	if (threaded && multi_session) {
+		fprintf(stderr, "-N cannot be combined with -M\n");
+		return EXIT_FAILURE;
+	}
 
-	ret = sd_bus_open_user(&user_bus);
+	ret = config_load(&ctx.config, config_path);
 	if (ret < 0) {
-		fprintf(stderr, "could not connect to session bus: %s\n", strerror(-ret));
 		goto finish;
 	}
 
-	ret = sd_bus_open_system(&system_bus);
+	if (replay_path != NULL) {
+		// Replays never touch a bus, notifications are printed instead
+		if (threaded) {
+			ret = notifier_start(&notifier, NULL);
+			if (ret < 0) {
+				fprintf(stderr, "could not start notifier: %s\n", strerror(-ret));
+				goto finish;
+			}
+			ctx.notifier = &notifier;
+		}
+		ret = replay(&ctx, replay_path, replay_realtime);
+		goto finish;
+	}
+
+	if (record_path != NULL) {
+		ret = recorder_open(&recorder, record_path);
+		if (ret < 0) {
+			fprintf(stderr, "could not open recording %s: %s\n", record_path, strerror(-ret));
+			goto finish;
+		}
+		ctx.state.recorder = &recorder;
+	}
+
+	if (!multi_session) {
+		ret = sd_bus_open_user(&ctx.user_bus);
+		if (ret < 0) {
+			fprintf(stderr, "could not connect to session bus: %s\n", strerror(-ret));
+			goto finish;
+		}
+	}
+
+	ret = sd_bus_open_system(&ctx.system_bus);
 	if (ret < 0) {
 		fprintf(stderr, "could not connect to system bus: %s\n", strerror(-ret));
 		goto finish;
 	}
 
-	state.bus = system_bus;
+	if (threaded) {
+		// The notifier thread watches the notification daemon itself
+		ret = notifier_start(&notifier, ctx.user_bus);
+		ctx.user_bus = NULL;
+		if (ret < 0) {
+			fprintf(stderr, "could not start notifier: %s\n", strerror(-ret));
+			goto finish;
+		}
+		ctx.notifier = &notifier;
+	}
 
-	ret = init_upower(system_bus, &state);
+	if (ctx.user_bus != NULL) {
+		ret = sd_bus_add_match(
+			ctx.user_bus,
+			NULL,
+			"type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.freedesktop.Notifications'",
+			handle_notifications_owner_changed,
+			&ctx);
+		if (ret < 0) {
+			fprintf(stderr, "could not watch notification daemon: %s\n", strerror(-ret));
+			goto finish;
+		}
+		ret = notify_watch_closed(ctx.user_bus, handle_notification_closed, &ctx);
+		if (ret < 0) {
+			fprintf(stderr, "could not watch notifications: %s\n", strerror(-ret));
+			goto finish;
+		}
+	}
+
+	if (multi_session) {
+		ret = init_sessions(ctx.system_bus, &sessions);
+		if (ret < 0) {
+			fprintf(stderr, "could not list sessions: %s\n", strerror(-ret));
+			goto finish;
+		}
+		ctx.sessions = &sessions;
+	}
+
+	ctx.state.bus = ctx.system_bus;
+	ctx.state.policy = device_policy;
+	ctx.state.policy_data = &ctx;
+
+	// Restoring the last snapshot first means anything already notified
+	// about before a restart is not notified about again
+	if (use_snapshot && snapshot_init(&snapshot) == 0) {
+		ret = snapshot_load(&snapshot, &ctx.state);
+		if (ret < 0) {
+			fprintf(stderr, "could not load snapshot %s: %s\n", snapshot.path, strerror(-ret));
+			goto finish;
+		}
+	}
+
+	ret = init_upower(ctx.system_bus, &ctx.state);
 	if (ret < 0) {
 		fprintf(stderr, "could not init upower: %s\n", strerror(-ret));
 		goto finish;
 	}
+	index_notifications(&ctx);
 
-	while (1) {
-		for (int idx = 0; idx < state.devices->length; idx++) {
-			struct upower_device *device = state.devices->items[idx];
-
-			if ((ignore_types_mask & (1 << device->type))) {
-				goto next_device;
-			}
-
-			if (!initialized && ignore_initial) {
-				goto next_device;
-			}
+	if (ctx.power_saving && prctl(PR_SET_TIMERSLACK, POWER_SAVING_TIMER_SLACK_NS, 0, 0, 0) == -1) {
+		fprintf(stderr, "could not set timer slack: %s\n", strerror(errno));
+	}
 
-			if (ignore_non_power_supplies && !device->power_supply) {
-				goto next_device;
-			}
+	while (1) {
+		if (ctx.notifier != NULL) {
+			process_notifier_replies(&ctx);
+		}
+		ret = process_devices(&ctx);
+		if (ret < 0) {
+			goto finish;
+		}
 
-			if (upower_device_has_battery(device)) {
-				ret = send_state_update(user_bus, device);
-				if (ret < 0) {
-					fprintf(stderr, "could not send state update notification: %s\n", strerror(-ret));
-					goto finish;
-				}
-				ret = send_warning_update(user_bus, device);
+		// Housekeeping waits for a lull when saving power
+		if (!ctx.power_saving || now_ms() >= ctx.deferred_ms) {
+			ctx.deferred_ms = UINT64_MAX;
+			if (snapshot.path != NULL) {
+				ret = snapshot_save(&snapshot, &ctx.state);
 				if (ret < 0) {
-					fprintf(stderr, "could not send warning update notification: %s\n", strerror(-ret));
-					goto finish;
-				}
-			} else {
-				ret = send_online_update(user_bus, device);
-				if (ret < 0) {
-					fprintf(stderr, "could not send online update notification: %s\n", strerror(-ret));
-					goto finish;
+					fprintf(stderr, "could not save snapshot %s: %s\n", snapshot.path, strerror(-ret));
+					snapshot_finish(&snapshot);
 				}
 			}
-next_device:
-			device->last = device->current;
+		}
+		if (ctx.power_saving || trace_enabled) {
+			report_wakeups(&ctx);
 		}
 
-		for (int idx = 0; idx < state.removed_devices->length; idx++) {
-			struct upower_device *device = state.removed_devices->items[idx];
-
-			if ((ignore_types_mask & (1 << device->type))) {
-				continue;
-			}
+		if (ctx.sessions != NULL) {
+			sessions_process(ctx.sessions);
+		}
 
-			if (ignore_non_power_supplies && !device->power_supply) {
-				continue;
-			}
+		ret = process_bus(ctx.system_bus, ctx.power_saving);
+		if (ret < 0) {
+			fprintf(stderr, "could not process system bus messages: %s\n", strerror(-ret));
+			goto finish;
+		}
+		int processed = ret;
 
-			ret = send_remove(user_bus, device);
+		if (ctx.user_bus != NULL) {
+			ret = process_bus(ctx.user_bus, ctx.power_saving);
 			if (ret < 0) {
-				fprintf(stderr, "could not send device removal notification: %s\n", strerror(-ret));
+				fprintf(stderr, "could not process session bus messages: %s\n", strerror(-ret));
 				goto finish;
 			}
-			upower_device_destroy(device);
-			list_del(state.removed_devices, idx);
+			processed |= ret;
 		}
 
-		ret = sd_bus_process(system_bus, NULL);
-		if (ret < 0) {
-			fprintf(stderr, "could not process system bus messages: %s\n", strerror(-ret));
-			goto finish;
-		} else if (ret > 0) {
+		if (processed) {
+			// Each batch pushes housekeeping back, so that it runs
+			// once the bus has gone quiet
+			if (ctx.power_saving) {
+				ctx.deferred_ms = now_ms() + POWER_SAVING_DEFER_MS;
+			}
 			continue;
 		}
 
-		ret = sd_bus_wait(system_bus, UINT64_MAX);
+		ret = wait_for_events(&ctx);
 		if (ret < 0) {
-			fprintf(stderr, "could not wait for system bus messages: %s\n", strerror(-ret));
+			fprintf(stderr, "could not wait for events: %s\n", strerror(-ret));
 			goto finish;
 		}
 
-		if (!initialized) {
-			initialized = milliseconds_since(&start) > 500;
+		if (config_process(&ctx.config) > 0) {
+			ret = upower_refresh_policies(&ctx.state);
+			if (ret < 0) {
+				fprintf(stderr, "could not apply config: %s\n", strerror(-ret));
+				goto finish;
+			}
+		}
+
+		if (!ctx.initialized) {
+			ctx.initialized = milliseconds_since(&start) > 500;
 		}
 	}
 
 finish:
-	destroy_upower(system_bus, &state);
-	sd_bus_unref(user_bus);
-	sd_bus_unref(system_bus);
+	if (ctx.notifier != NULL) {
+		notifier_stop(ctx.notifier);
+	}
+	destroy_upower(ctx.system_bus, &ctx.state);
+	destroy_sessions(&sessions);
+	snapshot_finish(&snapshot);
+	sd_bus_unref(ctx.user_bus);
+	sd_bus_unref(ctx.system_bus);
+	hooks_destroy(&ctx.hooks);
+	recorder_close(&recorder);
+	config_finish(&ctx.config);
+	list_free(ctx.departing);
+	rate_limiter_finish(&ctx.limiter);
+	id_map_finish(&ctx.ids);
+	free(ctx.pollfds);
 
 	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
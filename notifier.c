@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbus.h"
+#include "notifier.h"
+#include "notify.h"
+#include "ring.h"
+
+static void wake(int fd) {
+	uint64_t one = 1;
+	// A full counter still wakes the reader, so failure is harmless
+	(void)!write(fd, &one, sizeof(one));
+}
+
+static void drain(int fd) {
+	uint64_t count;
+	(void)!read(fd, &count, sizeof(count));
+}
+
+static void push_reply(struct notifier *notifier, const struct notifier_reply *reply) {
+	if (!ring_push(&notifier->replies, reply)) {
+		// Only costs replacing a notification rather than updating it
+		fprintf(stderr, "dropped notification ID, event loop backed up\n");
+	}
+}
+
+static int handle_owner_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct notifier *notifier = userdata;
+	struct notifier_reply reply = { .slot = -1 };
+	const char *name, *old_owner, *new_owner;
+	notifier->capabilities = -1;
+	if (sd_bus_message_read(msg, "sss", &name, &old_owner, &new_owner) > 0 && old_owner[0] != '\0') {
+		push_reply(notifier, &reply);
+		wake(notifier->fd);
+	}
+	return 0;
+}
+
+static int handle_closed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct notifier *notifier = userdata;
+	struct notifier_reply reply = { .slot = -1, .closed = true };
+	if (sd_bus_message_read(msg, "u", &reply.id) > 0) {
+		push_reply(notifier, &reply);
+		wake(notifier->fd);
+	}
+	return 0;
+}
+
+static void send_request(struct notifier *notifier, struct notifier_request *request) {
+	uint32_t *id = request->slot >= 0 ? &request->id : NULL;
+	int ret = notify_adapted(notifier->bus, &notifier->capabilities, request->summary, request->body,
+		request->category, id, request->urgency, request->value);
+	if (ret < 0) {
+		// Most likely the notification daemon is restarting
+		fprintf(stderr, "could not send %s notification: %s\n", request->category, strerror(-ret));
+		return;
+	}
+	if (id != NULL) {
+		struct notifier_reply reply = { .slot = request->slot, .id = request->id };
+		memcpy(reply.path, request->path, sizeof(reply.path));
+		push_reply(notifier, &reply);
+	}
+}
+
+static int wait_for_requests(struct notifier *notifier) {
+	struct pollfd fds[2] = {
+		{ .fd = notifier->wake_fd, .events = POLLIN },
+		{ .fd = -1 },
+	};
+	int timeout = -1;
+
+	if (notifier->bus != NULL) {
+		int fd = sd_bus_get_fd(notifier->bus);
+		if (fd < 0) {
+			return fd;
+		}
+		int events = sd_bus_get_events(notifier->bus);
+		if (events < 0) {
+			return events;
+		}
+		uint64_t bus_timeout;
+		int ret = sd_bus_get_timeout(notifier->bus, &bus_timeout);
+		if (ret < 0) {
+			return ret;
+		}
+		if (bus_timeout != UINT64_MAX) {
+			struct timespec current;
+			clock_gettime(CLOCK_MONOTONIC, &current);
+			uint64_t now = (uint64_t)current.tv_sec * 1000000 + current.tv_nsec / 1000;
+			timeout = bus_timeout > now ? (int)((bus_timeout - now + 999) / 1000) : 0;
+		}
+		fds[1] = (struct pollfd){ .fd = fd, .events = events };
+	}
+
+	if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+		return -errno;
+	}
+	drain(notifier->wake_fd);
+	return 0;
+}
+
+static void *notifier_run(void *data) {
+	struct notifier *notifier = data;
+	struct notifier_request request;
+	int ret;
+
+	while (1) {
+		while (ring_pop(&notifier->requests, &request)) {
+			send_request(notifier, &request);
+			// Lets the event loop hand over what it held back, and pick up
+			// the ID
+			wake(notifier->fd);
+		}
+		// Checked only once the ring is empty, so that nothing already
+		// handed over is lost
+		if (atomic_load(&notifier->stop)) {
+			break;
+		}
+
+		if (notifier->bus != NULL) {
+			while ((ret = sd_bus_process(notifier->bus, NULL)) > 0) {
+			}
+			if (ret < 0) {
+				fprintf(stderr, "could not process session bus messages: %s\n", strerror(-ret));
+				break;
+			}
+		}
+
+		ret = wait_for_requests(notifier);
+		if (ret < 0) {
+			fprintf(stderr, "could not wait for notifications: %s\n", strerror(-ret));
+			break;
+		}
+	}
+	return NULL;
+}
+
+int notifier_start(struct notifier *notifier, sd_bus *bus) {
+	int ret;
+
+	notifier->bus = bus;
+	notifier->capabilities = -1;
+	notifier->wake_fd = notifier->fd = -1;
+	atomic_init(&notifier->stop, false);
+
+	ret = ring_init(&notifier->requests, sizeof(struct notifier_request), NOTIFIER_RING_SIZE);
+	if (ret < 0) {
+		goto error;
+	}
+	// Replies are only taken between handing over notifications, so
+	// there can be a ring's worth of them on either side of that
+	ret = ring_init(&notifier->replies, sizeof(struct notifier_reply), 2 * NOTIFIER_RING_SIZE);
+	if (ret < 0) {
+		goto error;
+	}
+
+	notifier->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	notifier->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notifier->wake_fd == -1 || notifier->fd == -1) {
+		ret = -errno;
+		goto error;
+	}
+
+	if (bus != NULL) {
+		ret = sd_bus_add_match(
+			bus,
+			NULL,
+			"type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.freedesktop.Notifications'",
+			handle_owner_changed,
+			notifier);
+		if (ret < 0) {
+			goto error;
+		}
+		ret = notify_watch_closed(bus, handle_closed, notifier);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	ret = -pthread_create(&notifier->thread, NULL, notifier_run, notifier);
+	if (ret < 0) {
+		goto error;
+	}
+	notifier->running = true;
+	return 0;
+
+error:
+	notifier_stop(notifier);
+	return ret;
+}
+
+void notifier_stop(struct notifier *notifier) {
+	if (notifier->running) {
+		atomic_store(&notifier->stop, true);
+		wake(notifier->wake_fd);
+		pthread_join(notifier->thread, NULL);
+		notifier->running = false;
+	}
+
+	if (notifier->wake_fd != -1) {
+		close(notifier->wake_fd);
+		notifier->wake_fd = -1;
+	}
+	if (notifier->fd != -1) {
+		close(notifier->fd);
+		notifier->fd = -1;
+	}
+	ring_finish(&notifier->requests);
+	ring_finish(&notifier->replies);
+	notifier->bus = sd_bus_unref(notifier->bus);
+}
+
+int notifier_send(struct notifier *notifier, const struct notifier_request *request) {
+	if (!ring_push(&notifier->requests, request)) {
+		return -EAGAIN;
+	}
+	wake(notifier->wake_fd);
+	return 0;
+}
+
+bool notifier_busy(struct notifier *notifier) {
+	return ring_full(&notifier->requests);
+}
+
+bool notifier_reply(struct notifier *notifier, struct notifier_reply *reply) {
+	if (ring_pop(&notifier->replies, reply)) {
+		return true;
+	}
+	drain(notifier->fd);
+	// A reply may have come in between popping and draining
+	return ring_pop(&notifier->replies, reply);
+}
@@ -0,0 +1,78 @@
+#ifndef _NOTIFIER_H
+#define _NOTIFIER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dbus.h"
+#include "notify.h"
+#include "ring.h"
+#include "upower.h"
+
+// Notifications that can be waiting for the notifier thread at once
+#define NOTIFIER_RING_SIZE 64
+
+#define NOTIFIER_BODY_MAX_LEN 512
+#define NOTIFIER_CATEGORY_MAX_LEN 64
+
+// A notification for the notifier thread to send. Devices are referred to
+// by path, as they may be gone by the time the notification is sent.
+struct notifier_request {
+	char path[UPOWER_DEVICE_STR_MAX];
+	int slot;
+	uint32_t id;
+	char summary[NOTIFY_SUMMARY_MAX_LEN];
+	char body[NOTIFIER_BODY_MAX_LEN];
+	char category[NOTIFIER_CATEGORY_MAX_LEN];
+	enum urgency urgency;
+	int value;
+};
+
+// The notification ID to keep for a device slot. An empty path means that
+// the notification daemon changed, and every ID is to be forgotten, and
+// closed that the notification with the ID is gone.
+struct notifier_reply {
+	char path[UPOWER_DEVICE_STR_MAX];
+	int slot;
+	uint32_t id;
+	bool closed;
+};
+
+// Sends notifications from a thread of its own, so that a slow or hung
+// notification daemon never holds up the event loop. The thread owns the
+// session bus; the event loop only ever talks to it through the rings.
+struct notifier {
+	sd_bus *bus;
+	int capabilities;
+	struct ring requests;
+	struct ring replies;
+
+	// Wakes the notifier thread, and the event loop as notifications are
+	// sent respectively
+	int wake_fd;
+	int fd;
+
+	atomic_bool stop;
+	pthread_t thread;
+	bool running;
+};
+
+// Starts the notifier thread, taking over the reference to bus. A NULL bus
+// prints notifications, as when replaying.
+int notifier_start(struct notifier *notifier, sd_bus *bus);
+
+// Drains the notifications still waiting and stops the thread
+void notifier_stop(struct notifier *notifier);
+
+// Hands a notification to the notifier thread, -EAGAIN if it is backed up
+int notifier_send(struct notifier *notifier, const struct notifier_request *request);
+
+// Whether notifier_send() would fail. fd becomes readable once it would not.
+bool notifier_busy(struct notifier *notifier);
+
+// Takes the next reply, if any, to be called when fd is readable
+bool notifier_reply(struct notifier *notifier, struct notifier_reply *reply);
+
+#endif
@@ -2,36 +2,79 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "dbus.h"
 #include "notify.h"
+#include "trace.h"
+
+int notify(sd_bus *bus, const char *summary, const char *body, const char *category, uint32_t *id,
+		enum urgency urgency, int value) {
+	TRACE(send, TRACE_SEND, category, summary);
+	if (bus == NULL) {
+		// No session bus when replaying, print what would have been sent
+		static uint32_t next_id = 1;
+		size_t len = strlen(body);
+		printf("[%s] %s\n%s%s", category, summary, body, len > 0 && body[len - 1] == '\n' ? "" : "\n");
+		if (value >= 0) {
+			printf("(value %d)\n", value);
+		}
+		if (id != NULL && *id == 0) {
+			*id = next_id++;
+		}
+		TRACE(reply, TRACE_REPLY, category, NULL);
+		return 0;
+	}
 
-int notify(sd_bus *bus, char *summary, char *body, char *category, uint32_t *id, enum urgency urgency) {
 	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *call = NULL;
 	sd_bus_message *msg = NULL;
-	int ret = sd_bus_call_method(bus,
+	int ret = sd_bus_message_new_method_call(bus,
+	    &call,
 	    "org.freedesktop.Notifications",
 	    "/org/freedesktop/Notifications",
 	    "org.freedesktop.Notifications",
-	    "Notify",
-	    &error,
-	    &msg,
-	    "susssasa{sv}i",
-	    "poweralertd",
-	    id != NULL ? *id : 0,
-	    "",
-	    summary,
-	    body,
-	    0,
-	    2,
+	    "Notify");
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = sd_bus_message_append(call, "susssas", "poweralertd", id != NULL ? *id : 0, "", summary, body, 0);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_open_container(call, 'a', "{sv}");
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_append(call, "{sv}{sv}",
 	    "urgency", "y", (uint8_t)urgency,
-	    "category", "s", category,
-	    -1);
+	    "category", "s", category);
+	if (ret < 0) {
+		goto error;
+	}
+	if (value >= 0) {
+		// Rendered as a progress bar by servers supporting it
+		ret = sd_bus_message_append(call, "{sv}", "value", "i", value);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+	ret = sd_bus_message_close_container(call);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_append(call, "i", -1);
+	if (ret < 0) {
+		goto error;
+	}
 
+	ret = sd_bus_call(bus, call, 0, &error, &msg);
 	if (ret < 0) {
 		goto error;
 	}
+	TRACE(reply, TRACE_REPLY, category, NULL);
 
 	if (id != NULL) {
 		ret = sd_bus_message_read(msg, "u", id);
@@ -42,7 +85,86 @@ int notify(sd_bus *bus, char *summary, char *body, char *category, uint32_t *id,
 
 error:
 	sd_bus_error_free(&error);
+	sd_bus_message_unref(call);
 	sd_bus_message_unref(msg);
 
 	return ret;
 }
+
+int notify_capabilities(sd_bus *bus, int *capabilities) {
+	if (*capabilities >= 0) {
+		return 0;
+	}
+	if (bus == NULL) {
+		*capabilities = NOTIFY_CAPABILITY_BODY;
+		return 0;
+	}
+
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *msg = NULL;
+	int caps = 0;
+	int ret = sd_bus_call_method(bus,
+	    "org.freedesktop.Notifications",
+	    "/org/freedesktop/Notifications",
+	    "org.freedesktop.Notifications",
+	    "GetCapabilities",
+	    &error,
+	    &msg,
+	    "");
+	if (ret < 0) {
+		goto error;
+	}
+
+	ret = sd_bus_message_enter_container(msg, 'a', "s");
+	if (ret < 0) {
+		goto error;
+	}
+	const char *capability;
+	while ((ret = sd_bus_message_read(msg, "s", &capability)) > 0) {
+		if (strcmp(capability, "body") == 0) {
+			caps |= NOTIFY_CAPABILITY_BODY;
+		}
+	}
+	if (ret < 0) {
+		goto error;
+	}
+	*capabilities = caps;
+
+error:
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(msg);
+
+	return ret;
+}
+
+int notify_watch_closed(sd_bus *bus, sd_bus_message_handler_t handler, void *userdata) {
+	int ret = sd_bus_add_match(
+		bus,
+		NULL,
+		"type='signal',sender='org.freedesktop.Notifications',path='/org/freedesktop/Notifications',interface='org.freedesktop.Notifications',member='NotificationClosed'",
+		handler,
+		userdata);
+	if (ret < 0) {
+		return ret;
+	}
+
+	// Notifications close as their action is invoked unless resident,
+	// which ours never are
+	return sd_bus_add_match(
+		bus,
+		NULL,
+		"type='signal',sender='org.freedesktop.Notifications',path='/org/freedesktop/Notifications',interface='org.freedesktop.Notifications',member='ActionInvoked'",
+		handler,
+		userdata);
+}
+
+int notify_adapted(sd_bus *bus, int *capabilities, const char *summary, const char *body,
+		const char *category, uint32_t *id, enum urgency urgency, int value) {
+	char adapted[NOTIFY_SUMMARY_MAX_LEN];
+	if (value >= 0 && notify_capabilities(bus, capabilities) == 0 &&
+			!(*capabilities & NOTIFY_CAPABILITY_BODY)) {
+		snprintf(adapted, sizeof(adapted), "%s (%d%%)", summary, value);
+		summary = adapted;
+	}
+	return notify(bus, summary, body, category, id, urgency, value);
+}
@@ -3,6 +3,8 @@
 
 #include "dbus.h"
 
+#define NOTIFY_SUMMARY_MAX_LEN 128
+
 // Urgency values to be used as hint in org.freedesktop.Notifications.Notify calls.
 // https://people.gnome.org/~mccann/docs/notification-spec/notification-spec-latest.html#hints
 enum urgency {
@@ -11,6 +13,27 @@ enum urgency {
 	URGENCY_CRITICAL,
 };
 
-int notify(sd_bus *bus, char *summary, char *body, char *category, uint32_t *id, enum urgency urgency);
+// Capabilities of the notification server that change what we send
+enum notify_capability {
+	NOTIFY_CAPABILITY_BODY = 1 << 0,
+};
+
+// Sends a notification, replacing *id if non-zero. A value of 0 to 100 is
+// passed as the value hint, negative values are left out.
+int notify(sd_bus *bus, const char *summary, const char *body, const char *category, uint32_t *id,
+		enum urgency urgency, int value);
+
+// Fills in the capabilities of the notification server, unless already
+// known. -1 means unknown, so that resetting the cache refetches them.
+int notify_capabilities(sd_bus *bus, int *capabilities);
+
+// Calls handler for notifications that closed, or closed as their action
+// was invoked. Either way the message starts with the notification ID.
+int notify_watch_closed(sd_bus *bus, sd_bus_message_handler_t handler, void *userdata);
+
+// Notifies with an optional progress value, like notify(). Servers that do
+// not show bodies get the value in the summary instead.
+int notify_adapted(sd_bus *bus, int *capabilities, const char *summary, const char *body,
+		const char *category, uint32_t *id, enum urgency urgency, int value);
 
 #endif
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "alert.h"
+#include "notify.h"
+#include "queue.h"
+#include "upower.h"
+
+enum alert_priority alert_priority(struct upower_device *device, const struct alert_action *action) {
+	if (action->urgency == URGENCY_CRITICAL) {
+		return ALERT_PRIORITY_URGENT;
+	}
+	if (device->power_supply || action->kind == ALERT_WARNING || action->kind == ALERT_REMOVED ||
+			action->kind == ALERT_HEALTH) {
+		return ALERT_PRIORITY_NORMAL;
+	}
+	return ALERT_PRIORITY_ROUTINE;
+}
+
+static bool before(const struct queued_alert *a, const struct queued_alert *b) {
+	if (a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+	return a->seq < b->seq;
+}
+
+static void swap(struct alert_queue *queue, int a, int b) {
+	struct queued_alert tmp = queue->items[a];
+	queue->items[a] = queue->items[b];
+	queue->items[b] = tmp;
+}
+
+static void sift_up(struct alert_queue *queue, int idx) {
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		if (!before(&queue->items[idx], &queue->items[parent])) {
+			break;
+		}
+		swap(queue, idx, parent);
+		idx = parent;
+	}
+}
+
+static void sift_down(struct alert_queue *queue, int idx) {
+	while (1) {
+		int first = idx;
+		int left = idx * 2 + 1, right = idx * 2 + 2;
+		if (left < queue->length && before(&queue->items[left], &queue->items[first])) {
+			first = left;
+		}
+		if (right < queue->length && before(&queue->items[right], &queue->items[first])) {
+			first = right;
+		}
+		if (first == idx) {
+			break;
+		}
+		swap(queue, idx, first);
+		idx = first;
+	}
+}
+
+static void remove_at(struct alert_queue *queue, int idx) {
+	queue->length--;
+	if (idx == queue->length) {
+		return;
+	}
+	queue->items[idx] = queue->items[queue->length];
+	sift_up(queue, idx);
+	sift_down(queue, idx);
+}
+
+bool alert_queue_push(struct alert_queue *queue, struct upower_device *device,
+		const struct alert_action *action, uint32_t suppressed) {
+	struct queued_alert alert = {
+		.device = device,
+		.action = *action,
+		.priority = alert_priority(device, action),
+		.seq = queue->seq++,
+		.suppressed = suppressed,
+	};
+
+	for (int idx = 0; idx < queue->length; idx++) {
+		struct queued_alert *pending = &queue->items[idx];
+		if (pending->device == device && pending->action.kind == action->kind &&
+				(action->kind != ALERT_HEALTH ||
+				 strcmp(pending->action.category, action->category) == 0)) {
+			// Keep the place in line of the alert being replaced, and
+			// what it stood in for
+			alert.seq = pending->seq;
+			alert.suppressed += pending->suppressed;
+			queue->items[idx] = alert;
+			sift_up(queue, idx);
+			sift_down(queue, idx);
+			return true;
+		}
+	}
+
+	if (queue->length == ALERT_QUEUE_MAX) {
+		// The least important alert is one of the leaves
+		int last = ALERT_QUEUE_MAX / 2;
+		for (int idx = last + 1; idx < queue->length; idx++) {
+			if (before(&queue->items[last], &queue->items[idx])) {
+				last = idx;
+			}
+		}
+		queue->dropped++;
+		if (!before(&alert, &queue->items[last])) {
+			return false;
+		}
+		remove_at(queue, last);
+	}
+
+	queue->items[queue->length] = alert;
+	sift_up(queue, queue->length++);
+	return true;
+}
+
+const struct queued_alert *alert_queue_peek(struct alert_queue *queue) {
+	return queue->length > 0 ? &queue->items[0] : NULL;
+}
+
+bool alert_queue_pop(struct alert_queue *queue, struct queued_alert *alert) {
+	if (queue->length == 0) {
+		return false;
+	}
+	*alert = queue->items[0];
+	remove_at(queue, 0);
+	return true;
+}
+
+bool alert_queue_contains(struct alert_queue *queue, struct upower_device *device, enum alert_kind kind) {
+	for (int idx = 0; idx < queue->length; idx++) {
+		if (queue->items[idx].device == device && queue->items[idx].action.kind == kind) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void alert_queue_forget_device(struct alert_queue *queue, struct upower_device *device) {
+	int length = 0;
+	for (int idx = 0; idx < queue->length; idx++) {
+		if (queue->items[idx].device != device) {
+			queue->items[length++] = queue->items[idx];
+		}
+	}
+	if (length == queue->length) {
+		return;
+	}
+	queue->length = length;
+	for (int idx = length / 2 - 1; idx >= 0; idx--) {
+		sift_down(queue, idx);
+	}
+}
+
+bool alert_batchable(const struct alert_action *action) {
+	return action->urgency != URGENCY_CRITICAL &&
+		(action->kind == ALERT_REMOVED || action->kind == ALERT_ONLINE);
+}
+
+bool alert_batch_remove(struct alert_batch *batch, struct upower_device *device) {
+	for (int idx = 0; idx < batch->length; idx++) {
+		if (batch->devices[idx] == device) {
+			memmove(&batch->devices[idx], &batch->devices[idx + 1],
+				(batch->length - idx - 1) * sizeof(batch->devices[0]));
+			batch->length--;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool alert_batch_add(struct alert_batches *batches, struct upower_device *device,
+		const struct alert_action *action, uint64_t deadline) {
+	struct alert_batch *batch = NULL;
+
+	for (int idx = 0; idx < ALERT_BATCHES; idx++) {
+		struct alert_batch *candidate = &batches->items[idx];
+		if (candidate->length == 0) {
+			if (batch == NULL) {
+				batch = candidate;
+			}
+			continue;
+		}
+		if (strcmp(candidate->action.category, action->category) == 0) {
+			batch = candidate;
+		} else if (action->kind == ALERT_ONLINE && candidate->action.kind == ALERT_ONLINE &&
+				alert_batch_remove(candidate, device)) {
+			// Back to where it was before the batch started
+			return true;
+		}
+	}
+
+	if (batch == NULL || batch->length == ALERT_BATCH_DEVICES) {
+		return false;
+	}
+	if (batch->length == 0) {
+		batch->action = *action;
+		batch->deadline = deadline;
+	}
+	alert_batch_remove(batch, device);
+	batch->devices[batch->length++] = device;
+	return true;
+}
+
+bool alert_batch_contains(struct alert_batches *batches, struct upower_device *device) {
+	for (int idx = 0; idx < ALERT_BATCHES; idx++) {
+		struct alert_batch *batch = &batches->items[idx];
+		for (int dev = 0; dev < batch->length; dev++) {
+			if (batch->devices[dev] == device) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void alert_batch_forget_device(struct alert_batches *batches, struct upower_device *device) {
+	for (int idx = 0; idx < ALERT_BATCHES; idx++) {
+		alert_batch_remove(&batches->items[idx], device);
+	}
+}
+
+uint64_t alert_batch_next_deadline(struct alert_batches *batches) {
+	uint64_t deadline = UINT64_MAX;
+	for (int idx = 0; idx < ALERT_BATCHES; idx++) {
+		struct alert_batch *batch = &batches->items[idx];
+		if (batch->length > 0 && batch->deadline < deadline) {
+			deadline = batch->deadline;
+		}
+	}
+	return deadline;
+}
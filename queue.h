@@ -0,0 +1,84 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "alert.h"
+#include "upower.h"
+
+// The most alerts kept pending at once, beyond which the least important
+// are dropped
+#define ALERT_QUEUE_MAX 64
+
+enum alert_priority {
+	// State updates of peripherals, which may be deferred or dropped
+	ALERT_PRIORITY_ROUTINE,
+	// Anything about power supplies, warnings being cleared and removals
+	ALERT_PRIORITY_NORMAL,
+	// Critical alerts, always dispatched first and never deferred
+	ALERT_PRIORITY_URGENT,
+};
+
+struct queued_alert {
+	struct upower_device *device;
+	struct alert_action action;
+	enum alert_priority priority;
+	uint64_t seq;
+
+	// Alerts of the same category left out before this one by rate limiting
+	uint32_t suppressed;
+};
+
+// A binary max-heap of pending alerts ordered by priority, and by arrival
+// within the same priority. Fixed size, never allocates.
+struct alert_queue {
+	struct queued_alert items[ALERT_QUEUE_MAX];
+	int length;
+	uint64_t seq;
+	uint64_t dropped;
+};
+
+enum alert_priority alert_priority(struct upower_device *device, const struct alert_action *action);
+
+// Queues an alert. A pending alert of the same kind for the same device is
+// replaced rather than queued twice. When full, the least important alert
+// is dropped, and false is returned if that was the new one.
+bool alert_queue_push(struct alert_queue *queue, struct upower_device *device,
+		const struct alert_action *action, uint32_t suppressed);
+const struct queued_alert *alert_queue_peek(struct alert_queue *queue);
+bool alert_queue_pop(struct alert_queue *queue, struct queued_alert *alert);
+bool alert_queue_contains(struct alert_queue *queue, struct upower_device *device, enum alert_kind kind);
+void alert_queue_forget_device(struct alert_queue *queue, struct upower_device *device);
+
+// Devices sharing a batch are reported in a single notification
+#define ALERT_BATCH_DEVICES 16
+#define ALERT_BATCHES 4
+
+// Alerts of a category that tend to come in bursts, such as removals when
+// undocking, gathered until the deadline set by the first of them.
+struct alert_batch {
+	struct alert_action action;
+	struct upower_device *devices[ALERT_BATCH_DEVICES];
+	int length;
+	uint64_t deadline;
+};
+
+struct alert_batches {
+	struct alert_batch items[ALERT_BATCHES];
+};
+
+bool alert_batchable(const struct alert_action *action);
+
+// Adds an alert to the batch of its category, opening the batch with the
+// given deadline if needed. A device going back and forth between online
+// and offline within a batch is taken out of it instead. Returns false if
+// there is no room, in which case the alert is to be queued on its own.
+bool alert_batch_add(struct alert_batches *batches, struct upower_device *device,
+		const struct alert_action *action, uint64_t deadline);
+bool alert_batch_remove(struct alert_batch *batch, struct upower_device *device);
+bool alert_batch_contains(struct alert_batches *batches, struct upower_device *device);
+void alert_batch_forget_device(struct alert_batches *batches, struct upower_device *device);
+uint64_t alert_batch_next_deadline(struct alert_batches *batches);
+
+#endif
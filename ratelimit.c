@@ -0,0 +1,171 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alert.h"
+#include "list.h"
+#include "ratelimit.h"
+#include "upower.h"
+
+#ifdef POWERALERTD_DEVICE_POOL
+// Buckets are set aside along with the device pool, one per category for
+// every device, so that rate limiting never touches the heap either. A
+// bucket without a device is free.
+#define RATE_BUCKET_POOL (POWERALERTD_DEVICE_POOL * RATE_LIMIT_CATEGORIES)
+
+static struct rate_bucket bucket_pool[RATE_BUCKET_POOL];
+
+static struct rate_bucket *bucket_alloc(void) {
+	for (int idx = 0; idx < RATE_BUCKET_POOL; idx++) {
+		if (bucket_pool[idx].device == NULL) {
+			bucket_pool[idx] = (struct rate_bucket){ 0 };
+			return &bucket_pool[idx];
+		}
+	}
+	return NULL;
+}
+
+static void bucket_free(struct rate_bucket *bucket) {
+	bucket->device = NULL;
+}
+#else
+static struct rate_bucket *bucket_alloc(void) {
+	return calloc(1, sizeof(struct rate_bucket));
+}
+
+static void bucket_free(struct rate_bucket *bucket) {
+	free(bucket);
+}
+#endif
+
+void rate_limiter_init(struct rate_limiter *limiter) {
+#ifdef POWERALERTD_DEVICE_POOL
+	limiter->buckets = create_list_with_capacity(RATE_BUCKET_POOL);
+#else
+	limiter->buckets = create_list();
+#endif
+	limiter->suppressed = 0;
+}
+
+void rate_limiter_finish(struct rate_limiter *limiter) {
+	if (limiter->buckets == NULL) {
+		return;
+	}
+	for (int idx = 0; idx < limiter->buckets->length; idx++) {
+		bucket_free(limiter->buckets->items[idx]);
+	}
+	list_free(limiter->buckets);
+	limiter->buckets = NULL;
+}
+
+static void refill(struct rate_bucket *bucket, uint64_t now) {
+	if (now <= bucket->updated_ms) {
+		return;
+	}
+	bucket->tokens += (double)(now - bucket->updated_ms) * bucket->count / bucket->period_ms;
+	if (bucket->tokens > bucket->count) {
+		bucket->tokens = bucket->count;
+	}
+	bucket->updated_ms = now;
+}
+
+static struct rate_bucket *find_bucket(struct rate_limiter *limiter, struct upower_device *device,
+		const char *category) {
+	for (int idx = 0; idx < limiter->buckets->length; idx++) {
+		struct rate_bucket *bucket = limiter->buckets->items[idx];
+		if (bucket->device == device && strcmp(bucket->category, category) == 0) {
+			return bucket;
+		}
+	}
+	return NULL;
+}
+
+bool rate_limit_take(struct rate_limiter *limiter, struct upower_device *device,
+		const struct alert_action *action, int count, uint64_t period_ms, uint64_t now) {
+	if (count == 0 || period_ms == 0) {
+		return true;
+	}
+
+	struct rate_bucket *bucket = find_bucket(limiter, device, action->category);
+	if (bucket == NULL) {
+		// Better too many alerts than none
+		bucket = bucket_alloc();
+		if (bucket == NULL) {
+			return true;
+		}
+		if (list_add(limiter->buckets, bucket) < 0) {
+			bucket_free(bucket);
+			return true;
+		}
+		bucket->device = device;
+		bucket->category = action->category;
+		bucket->tokens = count;
+		bucket->updated_ms = now;
+	}
+
+	// Limits may have been changed by a config reload meanwhile
+	bucket->count = count;
+	bucket->period_ms = period_ms;
+	refill(bucket, now);
+
+	if (bucket->tokens >= 1 && bucket->suppressed == 0) {
+		bucket->tokens -= 1;
+		return true;
+	}
+
+	bucket->suppressed++;
+	bucket->last = *action;
+	limiter->suppressed++;
+	return false;
+}
+
+bool rate_limit_release(struct rate_limiter *limiter, uint64_t now,
+		struct upower_device **device, struct alert_action *action, uint32_t *suppressed) {
+	for (int idx = 0; idx < limiter->buckets->length; idx++) {
+		struct rate_bucket *bucket = limiter->buckets->items[idx];
+		if (bucket->suppressed == 0) {
+			continue;
+		}
+		refill(bucket, now);
+		if (bucket->tokens < 1) {
+			continue;
+		}
+
+		bucket->tokens -= 1;
+		*device = bucket->device;
+		*action = bucket->last;
+		*suppressed = bucket->suppressed - 1;
+		bucket->suppressed = 0;
+		return true;
+	}
+	return false;
+}
+
+uint64_t rate_limit_next_release(struct rate_limiter *limiter) {
+	uint64_t deadline = UINT64_MAX;
+	for (int idx = 0; idx < limiter->buckets->length; idx++) {
+		struct rate_bucket *bucket = limiter->buckets->items[idx];
+		if (bucket->suppressed == 0) {
+			continue;
+		}
+		uint64_t refilled = bucket->updated_ms;
+		if (bucket->tokens < 1) {
+			refilled += (uint64_t)((1 - bucket->tokens) * bucket->period_ms / bucket->count) + 1;
+		}
+		if (refilled < deadline) {
+			deadline = refilled;
+		}
+	}
+	return deadline;
+}
+
+void rate_limit_forget_device(struct rate_limiter *limiter, struct upower_device *device) {
+	for (int idx = 0; idx < limiter->buckets->length; idx++) {
+		struct rate_bucket *bucket = limiter->buckets->items[idx];
+		if (bucket->device == device) {
+			bucket_free(bucket);
+			list_del(limiter->buckets, idx--);
+		}
+	}
+}
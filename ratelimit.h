@@ -0,0 +1,52 @@
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "alert.h"
+#include "list.h"
+#include "upower.h"
+
+// Categories an alert can have, each limited on its own
+#define RATE_LIMIT_CATEGORIES 13
+
+// A token bucket for the alerts of one category about one device, holding
+// up to count tokens and refilling at count per period.
+struct rate_bucket {
+	struct upower_device *device;
+	const char *category;
+	double tokens;
+	uint64_t updated_ms;
+	int count;
+	uint64_t period_ms;
+
+	// Alerts left out since the bucket ran dry, and the latest of them
+	uint32_t suppressed;
+	struct alert_action last;
+};
+
+struct rate_limiter {
+	list_t *buckets;
+
+	// Alerts left out since startup
+	uint64_t suppressed;
+};
+
+void rate_limiter_init(struct rate_limiter *limiter);
+void rate_limiter_finish(struct rate_limiter *limiter);
+
+// Takes a token for the alert, returning false if there was none left, in
+// which case the alert is remembered for the summary sent once the bucket
+// refills. A count of 0 means no limit.
+bool rate_limit_take(struct rate_limiter *limiter, struct upower_device *device,
+		const struct alert_action *action, int count, uint64_t period_ms, uint64_t now);
+
+// Returns the latest alert left out of a bucket that has refilled since,
+// and how many were left out before it, taking a token for it.
+bool rate_limit_release(struct rate_limiter *limiter, uint64_t now,
+		struct upower_device **device, struct alert_action *action, uint32_t *suppressed);
+uint64_t rate_limit_next_release(struct rate_limiter *limiter);
+void rate_limit_forget_device(struct rate_limiter *limiter, struct upower_device *device);
+
+#endif
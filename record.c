@@ -0,0 +1,352 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+#include "upower.h"
+
+// File layout, all integers in host byte order:
+//
+//   header: "PWRREC" u16 version
+//   event:  u64 timestamp_us, u8 type, str path, then per type
+//     added:   str native_path, str model, u32 type, u8 power_supply, props
+//     removed: nothing
+//     changed: props
+//   props:  u16 mask, then each property present in mask in bit order,
+//           extended ones as 8 bytes each
+//   str:    u16 length, bytes
+//
+// Version 1 recordings have a u8 mask, and no extended properties.
+//
+// Only properties present in a signal are stored, so a typical
+// PropertiesChanged event costs around 30 bytes plus the path.
+
+static const char record_magic[6] = "PWRREC";
+#define RECORD_VERSION 2
+
+static int write_u8(FILE *f, uint8_t v) {
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -EIO;
+}
+
+static int write_u16(FILE *f, uint16_t v) {
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -EIO;
+}
+
+static int write_u32(FILE *f, uint32_t v) {
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -EIO;
+}
+
+static int write_u64(FILE *f, uint64_t v) {
+	return fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : -EIO;
+}
+
+static int write_str(FILE *f, const char *str) {
+	size_t len = str != NULL ? strlen(str) : 0;
+	if (len >= RECORD_STR_MAX) {
+		len = RECORD_STR_MAX - 1;
+	}
+	if (write_u16(f, len) < 0) {
+		return -EIO;
+	}
+	return fwrite(str, 1, len, f) == len ? 0 : -EIO;
+}
+
+static int write_props(FILE *f, uint32_t mask, const struct upower_device_props *props) {
+	int ret = write_u16(f, mask);
+	if (ret == 0 && (mask & UPOWER_DEVICE_PROP_ONLINE)) {
+		ret = write_u8(f, props->online);
+	}
+	if (ret == 0 && (mask & UPOWER_DEVICE_PROP_PERCENTAGE)) {
+		ret = fwrite(&props->percentage, sizeof(double), 1, f) == 1 ? 0 : -EIO;
+	}
+	if (ret == 0 && (mask & UPOWER_DEVICE_PROP_STATE)) {
+		ret = write_u32(f, props->state);
+	}
+	if (ret == 0 && (mask & UPOWER_DEVICE_PROP_WARNING_LEVEL)) {
+		ret = write_u32(f, props->warning_level);
+	}
+	if (ret == 0 && (mask & UPOWER_DEVICE_PROP_BATTERY_LEVEL)) {
+		ret = write_u32(f, props->battery_level);
+	}
+	for (size_t idx = 0; ret == 0 && idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+		const struct upower_extended_prop *prop = &upower_extended_props[idx];
+		if (mask & prop->bit) {
+			ret = fwrite((const char *)props + prop->offset, 8, 1, f) == 1 ? 0 : -EIO;
+		}
+	}
+	return ret;
+}
+
+static int write_event_header(struct recorder *rec, enum record_event_type type, const char *path) {
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+		return -errno;
+	}
+	uint64_t ts = (now.tv_sec - rec->start.tv_sec) * 1000000 + (now.tv_nsec - rec->start.tv_nsec) / 1000;
+
+	int ret = write_u64(rec->file, ts);
+	if (ret == 0) {
+		ret = write_u8(rec->file, type);
+	}
+	if (ret == 0) {
+		ret = write_str(rec->file, path);
+	}
+	return ret;
+}
+
+static int record_finish(struct recorder *rec, int ret) {
+	if (ret == 0 && fflush(rec->file) != 0) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		fprintf(stderr, "could not record event: %s\n", strerror(-ret));
+	}
+	return ret;
+}
+
+int recorder_open(struct recorder *rec, const char *path) {
+	if (clock_gettime(CLOCK_MONOTONIC, &rec->start) == -1) {
+		return -errno;
+	}
+	rec->file = fopen(path, "wb");
+	if (rec->file == NULL) {
+		return -errno;
+	}
+	if (fwrite(record_magic, sizeof(record_magic), 1, rec->file) != 1 ||
+			write_u16(rec->file, RECORD_VERSION) < 0) {
+		fclose(rec->file);
+		rec->file = NULL;
+		return -EIO;
+	}
+	return 0;
+}
+
+void recorder_close(struct recorder *rec) {
+	if (rec->file != NULL) {
+		fclose(rec->file);
+		rec->file = NULL;
+	}
+}
+
+int record_device_added(struct recorder *rec, struct upower_device *device) {
+	uint32_t mask = UPOWER_DEVICE_PROPS_BASIC | device->policy.props;
+	int ret = write_event_header(rec, RECORD_DEVICE_ADDED, device->path);
+	if (ret == 0) {
+		ret = write_str(rec->file, device->native_path);
+	}
+	if (ret == 0) {
+		ret = write_str(rec->file, device->model);
+	}
+	if (ret == 0) {
+		ret = write_u32(rec->file, device->type);
+	}
+	if (ret == 0) {
+		ret = write_u8(rec->file, device->power_supply);
+	}
+	if (ret == 0) {
+		ret = write_props(rec->file, mask, &device->current);
+	}
+	return record_finish(rec, ret);
+}
+
+int record_device_removed(struct recorder *rec, const char *path) {
+	return record_finish(rec, write_event_header(rec, RECORD_DEVICE_REMOVED, path));
+}
+
+int record_device_changed(struct recorder *rec, const char *path, uint32_t mask, const struct upower_device_props *props) {
+	int ret = write_event_header(rec, RECORD_DEVICE_CHANGED, path);
+	if (ret == 0) {
+		ret = write_props(rec->file, mask, props);
+	}
+	return record_finish(rec, ret);
+}
+
+static int read_exact(FILE *f, void *buf, size_t len) {
+	if (len > 0 && fread(buf, len, 1, f) != 1) {
+		return feof(f) ? -EINVAL : -EIO;
+	}
+	return 0;
+}
+
+static int read_str(FILE *f, char *buf) {
+	uint16_t len;
+	int ret = read_exact(f, &len, sizeof(len));
+	if (ret < 0) {
+		return ret;
+	}
+	if (len >= RECORD_STR_MAX) {
+		return -EINVAL;
+	}
+	ret = read_exact(f, buf, len);
+	buf[len] = '\0';
+	return ret;
+}
+
+static int read_u32(FILE *f, uint32_t *v) {
+	return read_exact(f, v, sizeof(*v));
+}
+
+static int read_props(FILE *f, uint16_t version, uint32_t *mask, struct upower_device_props *props) {
+	uint8_t m1, online;
+	uint16_t m;
+	uint32_t v;
+	int ret;
+	if (version == 1) {
+		ret = read_exact(f, &m1, sizeof(m1));
+		m = m1;
+	} else {
+		ret = read_exact(f, &m, sizeof(m));
+	}
+	*mask = m;
+	if (ret == 0 && (m & UPOWER_DEVICE_PROP_ONLINE)) {
+		ret = read_exact(f, &online, sizeof(online));
+		props->online = online;
+	}
+	if (ret == 0 && (m & UPOWER_DEVICE_PROP_PERCENTAGE)) {
+		ret = read_exact(f, &props->percentage, sizeof(double));
+	}
+	if (ret == 0 && (m & UPOWER_DEVICE_PROP_STATE)) {
+		ret = read_u32(f, &v);
+		props->state = v;
+	}
+	if (ret == 0 && (m & UPOWER_DEVICE_PROP_WARNING_LEVEL)) {
+		ret = read_u32(f, &v);
+		props->warning_level = v;
+	}
+	if (ret == 0 && (m & UPOWER_DEVICE_PROP_BATTERY_LEVEL)) {
+		ret = read_u32(f, &v);
+		props->battery_level = v;
+	}
+	for (size_t idx = 0; ret == 0 && idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+		const struct upower_extended_prop *prop = &upower_extended_props[idx];
+		if (m & prop->bit) {
+			ret = read_exact(f, (char *)props + prop->offset, 8);
+		}
+	}
+	return ret;
+}
+
+int replayer_open(struct replayer *rep, const char *path) {
+	char magic[sizeof(record_magic)];
+	uint16_t version;
+
+	rep->file = fopen(path, "rb");
+	if (rep->file == NULL) {
+		return -errno;
+	}
+	if (read_exact(rep->file, magic, sizeof(magic)) < 0 ||
+			memcmp(magic, record_magic, sizeof(magic)) != 0 ||
+			read_exact(rep->file, &version, sizeof(version)) < 0 ||
+			version < 1 || version > RECORD_VERSION) {
+		fclose(rep->file);
+		rep->file = NULL;
+		return -EINVAL;
+	}
+	rep->version = version;
+	return 0;
+}
+
+void replayer_close(struct replayer *rep) {
+	if (rep->file != NULL) {
+		fclose(rep->file);
+		rep->file = NULL;
+	}
+}
+
+// Returns 1 if an event was read, 0 at the end of the recording.
+int replayer_read(struct replayer *rep, struct record_event *event) {
+	uint8_t type;
+	int ret;
+
+	if (fread(&event->timestamp_us, sizeof(event->timestamp_us), 1, rep->file) != 1) {
+		return feof(rep->file) ? 0 : -EIO;
+	}
+	ret = read_exact(rep->file, &type, sizeof(type));
+	if (ret == 0) {
+		ret = read_str(rep->file, event->path);
+	}
+	if (ret < 0) {
+		return ret;
+	}
+
+	event->type = type;
+	event->mask = 0;
+	switch (event->type) {
+	case RECORD_DEVICE_ADDED:;
+		uint32_t device_type;
+		uint8_t power_supply;
+		ret = read_str(rep->file, event->native_path);
+		if (ret == 0) {
+			ret = read_str(rep->file, event->model);
+		}
+		if (ret == 0) {
+			ret = read_u32(rep->file, &device_type);
+			event->device_type = device_type;
+		}
+		if (ret == 0) {
+			ret = read_exact(rep->file, &power_supply, sizeof(power_supply));
+			event->power_supply = power_supply;
+		}
+		if (ret == 0) {
+			ret = read_props(rep->file, rep->version, &event->mask, &event->props);
+		}
+		break;
+	case RECORD_DEVICE_REMOVED:
+		break;
+	case RECORD_DEVICE_CHANGED:
+		ret = read_props(rep->file, rep->version, &event->mask, &event->props);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return ret < 0 ? ret : 1;
+}
+
+// Feeds a recorded event through the same paths as the live signal
+// handlers, minus the bus.
+int replayer_apply(struct upower *state, struct record_event *event) {
+	struct upower_device *device;
+	int ret;
+
+	switch (event->type) {
+	case RECORD_DEVICE_ADDED:
+		device = upower_add_device(state, event->path);
+		if (device == NULL) {
+			return -ENOMEM;
+		}
+		ret = upower_device_set_string(&device->native_path, event->native_path);
+		if (ret < 0) {
+			return ret;
+		}
+		ret = upower_device_set_string(&device->model, event->model);
+		if (ret < 0) {
+			return ret;
+		}
+		device->type = event->device_type;
+		device->power_supply = event->power_supply;
+		upower_device_apply(device, event->mask, &event->props);
+		return upower_device_subscribe(state, device);
+	case RECORD_DEVICE_REMOVED:
+		upower_remove_device(state, event->path);
+		break;
+	case RECORD_DEVICE_CHANGED:
+		for (int idx = 0; idx < state->devices->length; idx++) {
+			device = state->devices->items[idx];
+			if (strcmp(device->path, event->path) == 0) {
+				// Live, ignored devices are never subscribed to
+				if (!device->policy.ignored) {
+					upower_device_apply(device, event->mask, &event->props);
+				}
+				break;
+			}
+		}
+		break;
+	}
+	return 0;
+}
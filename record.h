@@ -0,0 +1,54 @@
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "upower.h"
+
+#define RECORD_STR_MAX 512
+
+enum record_event_type {
+	RECORD_DEVICE_ADDED = 1,
+	RECORD_DEVICE_REMOVED = 2,
+	RECORD_DEVICE_CHANGED = 3,
+};
+
+// A single decoded UPower signal. For added devices, mask covers every
+// monitored property and the static properties are filled in as well.
+struct record_event {
+	uint64_t timestamp_us;
+	enum record_event_type type;
+	char path[RECORD_STR_MAX];
+	char native_path[RECORD_STR_MAX];
+	char model[RECORD_STR_MAX];
+	enum upower_device_type device_type;
+	int power_supply;
+	uint32_t mask;
+	struct upower_device_props props;
+};
+
+struct recorder {
+	FILE *file;
+	struct timespec start;
+};
+
+int recorder_open(struct recorder *rec, const char *path);
+void recorder_close(struct recorder *rec);
+int record_device_added(struct recorder *rec, struct upower_device *device);
+int record_device_removed(struct recorder *rec, const char *path);
+int record_device_changed(struct recorder *rec, const char *path, uint32_t mask, const struct upower_device_props *props);
+
+struct replayer {
+	FILE *file;
+	uint16_t version;
+};
+
+int replayer_open(struct replayer *rep, const char *path);
+void replayer_close(struct replayer *rep);
+int replayer_read(struct replayer *rep, struct record_event *event);
+int replayer_apply(struct upower *state, struct record_event *event);
+
+#endif
@@ -0,0 +1,58 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *ring, size_t item_size, size_t capacity) {
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+		return -EINVAL;
+	}
+	ring->items = calloc(capacity, item_size);
+	if (ring->items == NULL) {
+		return -ENOMEM;
+	}
+	ring->item_size = item_size;
+	ring->capacity = capacity;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+void ring_finish(struct ring *ring) {
+	free(ring->items);
+	ring->items = NULL;
+}
+
+bool ring_push(struct ring *ring, const void *item) {
+	if (ring_full(ring)) {
+		return false;
+	}
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	memcpy(ring->items + (tail & (ring->capacity - 1)) * ring->item_size, item, ring->item_size);
+	// The item must be in place before the consumer can see the new tail
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool ring_full(struct ring *ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	return tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity;
+}
+
+bool ring_pop(struct ring *ring, void *item) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+
+	memcpy(item, ring->items + (head & (ring->capacity - 1)) * ring->item_size, ring->item_size);
+	// The item must be copied out before the producer can reuse its slot
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
@@ -0,0 +1,33 @@
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A lock-free ring passing fixed-size items from one producer thread to one
+// consumer thread. The capacity is a power of two so that the ever
+// increasing head and tail map to slots with a mask.
+struct ring {
+	unsigned char *items;
+	size_t item_size;
+	size_t capacity;
+
+	// Written by the consumer and producer respectively, kept apart so
+	// that they do not share a cache line
+	alignas(64) atomic_size_t head;
+	alignas(64) atomic_size_t tail;
+};
+
+int ring_init(struct ring *ring, size_t item_size, size_t capacity);
+void ring_finish(struct ring *ring);
+
+// Only ever called from the producer, false if the ring is full
+bool ring_push(struct ring *ring, const void *item);
+bool ring_full(struct ring *ring);
+
+// Only ever called from the consumer, false if the ring is empty
+bool ring_pop(struct ring *ring, void *item);
+
+#endif
@@ -0,0 +1,359 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include "dbus.h"
+#include "idmap.h"
+#include "list.h"
+#include "notify.h"
+#include "session.h"
+#include "upower.h"
+
+static int session_bus_connect(struct sessions *sessions, uid_t uid, sd_bus **bus) {
+	char address[256];
+	size_t len = 0;
+
+	for (const char *p = sessions->address; *p != '\0' && len < sizeof(address) - 1; p++) {
+		if (p[0] == '%' && p[1] == 'u') {
+			len += snprintf(address + len, sizeof(address) - len, "%u", (unsigned)uid);
+			p++;
+		} else {
+			address[len++] = *p;
+		}
+	}
+	if (len >= sizeof(address)) {
+		return -ENAMETOOLONG;
+	}
+	address[len] = '\0';
+
+	int ret = sd_bus_new(bus);
+	if (ret < 0) {
+		return ret;
+	}
+	ret = sd_bus_set_address(*bus, address);
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_set_bus_client(*bus, 1);
+	if (ret < 0) {
+		goto error;
+	}
+
+	// The session bus only accepts its own user, and both the peer
+	// credentials and the EXTERNAL authentication are taken from our
+	// effective uid while starting.
+	bool switch_uid = geteuid() == 0 && uid != 0;
+	if (switch_uid && seteuid(uid) == -1) {
+		ret = -errno;
+		goto error;
+	}
+	ret = sd_bus_start(*bus);
+	if (switch_uid && seteuid(0) == -1) {
+		fprintf(stderr, "could not restore effective uid: %s\n", strerror(errno));
+		abort();
+	}
+	if (ret < 0) {
+		goto error;
+	}
+	return 0;
+
+error:
+	*bus = sd_bus_unref(*bus);
+	return ret;
+}
+
+static void session_forget_notifications(struct session_bus *session) {
+	for (int idx = 0; idx < session->notifications->length; idx++) {
+		free(session->notifications->items[idx]);
+	}
+	session->notifications->length = 0;
+	id_map_clear(&session->ids);
+}
+
+static int handle_notification_closed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct session_bus *session = userdata;
+	uint32_t id;
+	if (sd_bus_message_read(msg, "u", &id) > 0) {
+		id_map_close(&session->ids, id);
+	}
+	return 0;
+}
+
+static int handle_notifications_owner_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct session_bus *session = userdata;
+	const char *name, *old_owner, *new_owner;
+	session->capabilities = -1;
+	if (sd_bus_message_read(msg, "sss", &name, &old_owner, &new_owner) > 0 && old_owner[0] != '\0') {
+		session_forget_notifications(session);
+	}
+	return 0;
+}
+
+static void session_bus_destroy(struct session_bus *session) {
+	if (session == NULL) {
+		return;
+	}
+	sd_bus_flush_close_unref(session->bus);
+	if (session->notifications != NULL) {
+		session_forget_notifications(session);
+		list_free(session->notifications);
+	}
+	id_map_finish(&session->ids);
+	free(session);
+}
+
+static struct session_bus *sessions_find(struct sessions *sessions, uid_t uid) {
+	for (int idx = 0; idx < sessions->buses->length; idx++) {
+		struct session_bus *session = sessions->buses->items[idx];
+		if (session->uid == uid) {
+			return session;
+		}
+	}
+	return NULL;
+}
+
+static bool session_is_graphical(sd_bus *bus, const char *path) {
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	char *type = NULL, *class = NULL, *state = NULL;
+	bool graphical = false;
+
+	if (sd_bus_get_property_string(bus, "org.freedesktop.login1", path,
+			"org.freedesktop.login1.Session", "Type", &error, &type) < 0 ||
+			sd_bus_get_property_string(bus, "org.freedesktop.login1", path,
+			"org.freedesktop.login1.Session", "Class", &error, &class) < 0 ||
+			sd_bus_get_property_string(bus, "org.freedesktop.login1", path,
+			"org.freedesktop.login1.Session", "State", &error, &state) < 0) {
+		goto finish;
+	}
+
+	graphical = (strcmp(type, "x11") == 0 || strcmp(type, "wayland") == 0 || strcmp(type, "mir") == 0) &&
+		strcmp(class, "user") == 0 && strcmp(state, "closing") != 0;
+
+finish:
+	free(type);
+	free(class);
+	free(state);
+	sd_bus_error_free(&error);
+	return graphical;
+}
+
+// Lists the logind sessions, connecting to the session bus of every user
+// with a graphical session and dropping those of users without one.
+static int sessions_sync(struct sessions *sessions) {
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *msg = NULL;
+	list_t *uids = create_list();
+	int ret;
+
+	ret = sd_bus_call_method(sessions->system_bus,
+	    "org.freedesktop.login1",
+	    "/org/freedesktop/login1",
+	    "org.freedesktop.login1.Manager",
+	    "ListSessions",
+	    &error,
+	    &msg,
+	    "");
+	if (ret < 0) {
+		goto finish;
+	}
+
+	ret = sd_bus_message_enter_container(msg, 'a', "(susso)");
+	if (ret < 0) {
+		goto finish;
+	}
+
+	while (1) {
+		const char *id, *user, *seat, *path;
+		uint32_t uid;
+		ret = sd_bus_message_read(msg, "(susso)", &id, &uid, &user, &seat, &path);
+		if (ret < 0) {
+			goto finish;
+		} else if (ret == 0) {
+			break;
+		}
+
+		if (!session_is_graphical(sessions->system_bus, path)) {
+			continue;
+		}
+		list_add(uids, (void *)(uintptr_t)uid);
+
+		if (sessions_find(sessions, uid) != NULL) {
+			continue;
+		}
+
+		struct session_bus *session = calloc(1, sizeof(struct session_bus));
+		if (session == NULL) {
+			ret = -ENOMEM;
+			goto finish;
+		}
+		session->uid = uid;
+		session->notifications = create_list();
+		session->capabilities = -1;
+		int r = session_bus_connect(sessions, uid, &session->bus);
+		if (r >= 0) {
+			r = sd_bus_add_match(
+				session->bus,
+				NULL,
+				"type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.freedesktop.Notifications'",
+				handle_notifications_owner_changed,
+				session);
+		}
+		if (r >= 0) {
+			r = notify_watch_closed(session->bus, handle_notification_closed, session);
+		}
+		if (r < 0) {
+			fprintf(stderr, "could not connect to session bus of uid %u: %s\n", uid, strerror(-r));
+			session_bus_destroy(session);
+			continue;
+		}
+		list_add(sessions->buses, session);
+	}
+
+	ret = sd_bus_message_exit_container(msg);
+	if (ret < 0) {
+		goto finish;
+	}
+
+	for (int idx = 0; idx < sessions->buses->length; idx++) {
+		struct session_bus *session = sessions->buses->items[idx];
+		if (list_find(uids, (void *)(uintptr_t)session->uid) == -1) {
+			session_bus_destroy(session);
+			list_del(sessions->buses, idx--);
+		}
+	}
+
+finish:
+	list_free(uids);
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(msg);
+	return ret;
+}
+
+static int handle_session_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct sessions *sessions = userdata;
+	int ret = sessions_sync(sessions);
+	if (ret < 0) {
+		fprintf(stderr, "handle_session_changed failed: %s\n", strerror(-ret));
+	}
+	return 0;
+}
+
+int init_sessions(sd_bus *system_bus, struct sessions *sessions) {
+	int ret;
+
+	sessions->system_bus = system_bus;
+	sessions->buses = create_list();
+	if (sessions->address == NULL) {
+		sessions->address = strdup(SESSION_ADDRESS_DEFAULT);
+	}
+
+	ret = sd_bus_add_match(
+		system_bus,
+		NULL,
+		"type='signal',sender='org.freedesktop.login1',path='/org/freedesktop/login1',interface='org.freedesktop.login1.Manager',member='SessionNew'",
+		handle_session_changed,
+		sessions);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_add_match(
+		system_bus,
+		NULL,
+		"type='signal',sender='org.freedesktop.login1',path='/org/freedesktop/login1',interface='org.freedesktop.login1.Manager',member='SessionRemoved'",
+		handle_session_changed,
+		sessions);
+	if (ret < 0) {
+		return ret;
+	}
+
+	return sessions_sync(sessions);
+}
+
+void destroy_sessions(struct sessions *sessions) {
+	if (sessions->buses != NULL) {
+		for (int idx = 0; idx < sessions->buses->length; idx++) {
+			session_bus_destroy(sessions->buses->items[idx]);
+		}
+		list_free(sessions->buses);
+		sessions->buses = NULL;
+	}
+	free(sessions->address);
+	sessions->address = NULL;
+}
+
+// Handles whatever the session buses have sent us without blocking, and
+// drops those that went away. They are reconnected by the next session
+// change.
+int sessions_process(struct sessions *sessions) {
+	if (sessions->buses == NULL) {
+		return 0;
+	}
+	for (int idx = 0; idx < sessions->buses->length; idx++) {
+		struct session_bus *session = sessions->buses->items[idx];
+		int ret;
+		while ((ret = sd_bus_process(session->bus, NULL)) > 0) {
+			// Drain
+		}
+		if (ret < 0) {
+			fprintf(stderr, "lost session bus of uid %u: %s\n", (unsigned)session->uid, strerror(-ret));
+			session_bus_destroy(session);
+			list_del(sessions->buses, idx--);
+		}
+	}
+	return 0;
+}
+
+// Returns the ID of a notification shown on a session bus, 0 if none
+uint32_t session_notification_id(struct session_bus *session, struct upower_device *device, int slot) {
+	for (int idx = 0; idx < session->notifications->length; idx++) {
+		struct session_notifications *entry = session->notifications->items[idx];
+		if (entry->device == device) {
+			return entry->notifications[slot];
+		}
+	}
+	return 0;
+}
+
+uint32_t *session_notification_slot(struct session_bus *session, struct upower_device *device, int slot) {
+	for (int idx = 0; idx < session->notifications->length; idx++) {
+		struct session_notifications *entry = session->notifications->items[idx];
+		if (entry->device == device) {
+			return &entry->notifications[slot];
+		}
+	}
+
+	struct session_notifications *entry = calloc(1, sizeof(struct session_notifications));
+	if (entry == NULL) {
+		return NULL;
+	}
+	entry->device = device;
+	list_add(session->notifications, entry);
+	return &entry->notifications[slot];
+}
+
+void sessions_forget_device(struct sessions *sessions, struct upower_device *device) {
+	if (sessions->buses == NULL) {
+		return;
+	}
+	for (int idx = 0; idx < sessions->buses->length; idx++) {
+		struct session_bus *session = sessions->buses->items[idx];
+		for (int entry = 0; entry < session->notifications->length; entry++) {
+			struct session_notifications *n = session->notifications->items[entry];
+			if (n->device == device) {
+				for (int slot = 0; slot < 3; slot++) {
+					id_map_take(&session->ids, n->notifications[slot]);
+				}
+				free(n);
+				list_del(session->notifications, entry);
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "dbus.h"
+#include "idmap.h"
+#include "list.h"
+#include "upower.h"
+
+#define SESSION_ADDRESS_DEFAULT "unix:path=/run/user/%u/bus"
+
+// Notification IDs for a device on one session bus
+struct session_notifications {
+	struct upower_device *device;
+	uint32_t notifications[3];
+};
+
+// The session bus of a user with at least one graphical session. Users
+// with several sessions share a single session bus.
+struct session_bus {
+	uid_t uid;
+	sd_bus *bus;
+	list_t *notifications;
+	struct id_map ids;
+
+	// Cached enum notify_capability bits of its server, -1 if unknown
+	int capabilities;
+};
+
+struct sessions {
+	list_t *buses;
+	sd_bus *system_bus;
+
+	// Session bus address, with %u replaced by the uid
+	char *address;
+};
+
+int init_sessions(sd_bus *system_bus, struct sessions *sessions);
+void destroy_sessions(struct sessions *sessions);
+int sessions_process(struct sessions *sessions);
+uint32_t *session_notification_slot(struct session_bus *session, struct upower_device *device, int slot);
+uint32_t session_notification_id(struct session_bus *session, struct upower_device *device, int slot);
+void sessions_forget_device(struct sessions *sessions, struct upower_device *device);
+
+#endif
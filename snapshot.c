@@ -0,0 +1,351 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "snapshot.h"
+#include "upower.h"
+
+// A snapshot of the device table, so that a restarted poweralertd knows
+// what it last notified about. All integers are in host byte order:
+//
+//   header:  "PWRSNAP" u8 version, u32 count, u32 length, u32 crc32
+//   device:  str path, str native_path, str model, u32 type,
+//            u8 power_supply, props last, u32 notifications[3]
+//   props:   u8 online, f64 percentage, u32 state, u32 warning_level,
+//            u32 battery_level, f64 temperature, f64 capacity
+//   str:     u16 length, bytes
+//
+// The checksum and length cover everything after the header.
+
+static const char snapshot_magic[7] = "PWRSNAP";
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_HEADER_LEN (sizeof(snapshot_magic) + 1 + 3 * sizeof(uint32_t))
+#define SNAPSHOT_STR_MAX 4096
+
+// Room taken by a device with the longest strings the pool allows
+#define SNAPSHOT_DEVICE_MAX_LEN (3 * (sizeof(uint16_t) + UPOWER_DEVICE_STR_MAX) + \
+	sizeof(uint32_t) + 2 * sizeof(uint8_t) + 3 * sizeof(double) + 6 * sizeof(uint32_t))
+
+static uint32_t crc32(const uint8_t *data, size_t len) {
+	uint32_t crc = 0xffffffff;
+	for (size_t idx = 0; idx < len; idx++) {
+		crc ^= data[idx];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+struct buffer {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+	size_t pos;
+	int error;
+};
+
+static void buffer_put(struct buffer *buf, const void *data, size_t len) {
+	if (buf->error) {
+		return;
+	}
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap * 2 : 256;
+		while (cap < buf->len + len) {
+			cap *= 2;
+		}
+		uint8_t *resized = realloc(buf->data, cap);
+		if (resized == NULL) {
+			buf->error = -ENOMEM;
+			return;
+		}
+		buf->data = resized;
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void put_u8(struct buffer *buf, uint8_t v) {
+	buffer_put(buf, &v, sizeof(v));
+}
+
+static void put_u32(struct buffer *buf, uint32_t v) {
+	buffer_put(buf, &v, sizeof(v));
+}
+
+static void put_str(struct buffer *buf, const char *str) {
+	uint16_t len = str != NULL ? strnlen(str, SNAPSHOT_STR_MAX - 1) : 0;
+	buffer_put(buf, &len, sizeof(len));
+	if (len > 0) {
+		buffer_put(buf, str, len);
+	}
+}
+
+static void buffer_get(struct buffer *buf, void *data, size_t len) {
+	if (buf->error || buf->pos + len > buf->len) {
+		buf->error = -EINVAL;
+		memset(data, 0, len);
+		return;
+	}
+	memcpy(data, buf->data + buf->pos, len);
+	buf->pos += len;
+}
+
+static uint8_t get_u8(struct buffer *buf) {
+	uint8_t v;
+	buffer_get(buf, &v, sizeof(v));
+	return v;
+}
+
+static uint32_t get_u32(struct buffer *buf) {
+	uint32_t v;
+	buffer_get(buf, &v, sizeof(v));
+	return v;
+}
+
+static char *get_str(struct buffer *buf) {
+	uint16_t len;
+	buffer_get(buf, &len, sizeof(len));
+	if (buf->error || len >= SNAPSHOT_STR_MAX || buf->pos + len > buf->len) {
+		buf->error = -EINVAL;
+		return NULL;
+	}
+	char *str = strndup((char *)buf->data + buf->pos, len);
+	if (str == NULL) {
+		buf->error = -ENOMEM;
+	}
+	buf->pos += len;
+	return str;
+}
+
+int snapshot_init(struct snapshot *snapshot) {
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	if (dir == NULL || dir[0] == '\0') {
+		return -ENOENT;
+	}
+	size_t len = strlen(dir) + strlen("/poweralertd.state") + 1;
+	snapshot->path = malloc(len);
+	if (snapshot->path == NULL) {
+		return -ENOMEM;
+	}
+	snprintf(snapshot->path, len, "%s/poweralertd.state", dir);
+
+#ifdef POWERALERTD_DEVICE_POOL
+	// Saves never need more room than a full pool
+	snapshot->cap = POWERALERTD_DEVICE_POOL * SNAPSHOT_DEVICE_MAX_LEN;
+	snapshot->data = malloc(snapshot->cap);
+	if (snapshot->data == NULL) {
+		snapshot->cap = 0;
+		return -ENOMEM;
+	}
+#endif
+	return 0;
+}
+
+void snapshot_finish(struct snapshot *snapshot) {
+	free(snapshot->path);
+	snapshot->path = NULL;
+	free(snapshot->data);
+	snapshot->data = NULL;
+	snapshot->cap = 0;
+}
+
+bool snapshot_props_differ(const struct upower_device_props *a, const struct upower_device_props *b) {
+	return a->online != b->online || a->percentage != b->percentage || a->state != b->state ||
+		a->warning_level != b->warning_level || a->battery_level != b->battery_level ||
+		a->temperature != b->temperature || a->capacity != b->capacity;
+}
+
+// Restores the devices of the last snapshot, so their last props and
+// notification IDs are in place before UPower is asked about them. A
+// missing, outdated or corrupt snapshot is not an error, it just means
+// starting from scratch.
+int snapshot_load(struct snapshot *snapshot, struct upower *state) {
+	uint8_t header[SNAPSHOT_HEADER_LEN];
+	struct buffer buf = { 0 };
+	uint32_t count, len, crc;
+	int ret = 0;
+
+	FILE *f = fopen(snapshot->path, "rb");
+	if (f == NULL) {
+		return errno == ENOENT ? 0 : -errno;
+	}
+
+	if (fread(header, sizeof(header), 1, f) != 1 ||
+			memcmp(header, snapshot_magic, sizeof(snapshot_magic)) != 0 ||
+			header[sizeof(snapshot_magic)] != SNAPSHOT_VERSION) {
+		goto finish;
+	}
+	memcpy(&count, header + sizeof(snapshot_magic) + 1, sizeof(count));
+	memcpy(&len, header + sizeof(snapshot_magic) + 1 + sizeof(count), sizeof(len));
+	memcpy(&crc, header + sizeof(snapshot_magic) + 1 + 2 * sizeof(count), sizeof(crc));
+
+	// The length is only trusted once the checksum matches, so make sure
+	// it does not claim more than the file holds before allocating
+	struct stat st;
+	if (fstat(fileno(f), &st) == -1) {
+		ret = -errno;
+		goto finish;
+	}
+	if ((uint64_t)st.st_size < SNAPSHOT_HEADER_LEN + (uint64_t)len) {
+		fprintf(stderr, "ignoring corrupt snapshot %s\n", snapshot->path);
+		goto finish;
+	}
+
+	buf.data = malloc(len);
+	if (buf.data == NULL) {
+		goto finish;
+	}
+	buf.len = buf.cap = len;
+	if (fread(buf.data, 1, len, f) != len || crc32(buf.data, len) != crc) {
+		fprintf(stderr, "ignoring corrupt snapshot %s\n", snapshot->path);
+		goto finish;
+	}
+
+	if (state->devices == NULL && upower_create_lists(state) < 0) {
+		ret = -ENOMEM;
+		goto finish;
+	}
+
+	for (uint32_t idx = 0; idx < count && !buf.error; idx++) {
+		char *path = get_str(&buf);
+		char *native_path = get_str(&buf);
+		char *model = get_str(&buf);
+		enum upower_device_type type = get_u32(&buf);
+		int power_supply = get_u8(&buf);
+		struct upower_device_props last = { 0 };
+		last.online = get_u8(&buf);
+		buffer_get(&buf, &last.percentage, sizeof(last.percentage));
+		last.state = get_u32(&buf);
+		last.warning_level = get_u32(&buf);
+		last.battery_level = get_u32(&buf);
+		buffer_get(&buf, &last.temperature, sizeof(last.temperature));
+		buffer_get(&buf, &last.capacity, sizeof(last.capacity));
+		uint32_t notifications[3];
+		for (int slot = 0; slot < 3; slot++) {
+			notifications[slot] = get_u32(&buf);
+		}
+
+		struct upower_device *device = NULL;
+		if (!buf.error) {
+			device = upower_add_device(state, path);
+		}
+		if (device != NULL && (upower_device_set_string(&device->native_path, native_path) < 0 ||
+				upower_device_set_string(&device->model, model) < 0)) {
+			buf.error = -ENOMEM;
+			device = NULL;
+		}
+		if (device != NULL) {
+			device->type = type;
+			device->power_supply = power_supply;
+			device->current = device->last = last;
+			memcpy(device->notifications, notifications, sizeof(notifications));
+
+			// Devices gone by now are removed without ever being looked at
+			// again, and their removal alert depends on the policy
+			int err = upower_device_subscribe(state, device);
+			if (err < 0) {
+				buf.error = err;
+			}
+		}
+		free(path);
+		free(native_path);
+		free(model);
+	}
+	ret = buf.error != -EINVAL ? buf.error : 0;
+
+	snapshot->crc = crc;
+	snapshot->len = len;
+
+finish:
+	free(buf.data);
+	fclose(f);
+	return ret;
+}
+
+// Writes the device table if it was marked dirty and changed since the
+// last write. The file is replaced atomically, so a crash never leaves a
+// torn snapshot behind.
+int snapshot_save(struct snapshot *snapshot, struct upower *state) {
+	struct buffer buf = { .data = snapshot->data, .cap = snapshot->cap };
+	int ret = 0;
+
+	if (!state->dirty) {
+		return 0;
+	}
+
+	for (int idx = 0; idx < state->devices->length; idx++) {
+		struct upower_device *device = state->devices->items[idx];
+		put_str(&buf, device->path);
+		put_str(&buf, device->native_path);
+		put_str(&buf, device->model);
+		put_u32(&buf, device->type);
+		put_u8(&buf, device->power_supply);
+		put_u8(&buf, device->last.online);
+		buffer_put(&buf, &device->last.percentage, sizeof(device->last.percentage));
+		put_u32(&buf, device->last.state);
+		put_u32(&buf, device->last.warning_level);
+		put_u32(&buf, device->last.battery_level);
+		buffer_put(&buf, &device->last.temperature, sizeof(device->last.temperature));
+		buffer_put(&buf, &device->last.capacity, sizeof(device->last.capacity));
+		for (int slot = 0; slot < 3; slot++) {
+			put_u32(&buf, device->notifications[slot]);
+		}
+	}
+	if (buf.error) {
+		ret = buf.error;
+		goto finish;
+	}
+
+	uint32_t crc = crc32(buf.data, buf.len);
+	if (crc == snapshot->crc && buf.len == snapshot->len) {
+		goto finish;
+	}
+
+	uint8_t header[SNAPSHOT_HEADER_LEN];
+	uint32_t count = state->devices->length, len = buf.len;
+	memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+	header[sizeof(snapshot_magic)] = SNAPSHOT_VERSION;
+	memcpy(header + sizeof(snapshot_magic) + 1, &count, sizeof(count));
+	memcpy(header + sizeof(snapshot_magic) + 1 + sizeof(count), &len, sizeof(len));
+	memcpy(header + sizeof(snapshot_magic) + 1 + 2 * sizeof(count), &crc, sizeof(crc));
+
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot->path);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		ret = -errno;
+		goto finish;
+	}
+	if (fwrite(header, sizeof(header), 1, f) != 1 ||
+			(buf.len > 0 && fwrite(buf.data, buf.len, 1, f) != 1)) {
+		ret = -EIO;
+	}
+	if (fclose(f) != 0 && ret == 0) {
+		ret = -errno;
+	}
+	if (ret == 0 && rename(tmp, snapshot->path) == -1) {
+		ret = -errno;
+	}
+	if (ret < 0) {
+		remove(tmp);
+		goto finish;
+	}
+
+	snapshot->crc = crc;
+	snapshot->len = buf.len;
+
+finish:
+	if (ret == 0) {
+		state->dirty = false;
+	}
+	snapshot->data = buf.data;
+	snapshot->cap = buf.cap;
+	return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "upower.h"
+
+struct snapshot {
+	char *path;
+
+	// Checksum and length of the last snapshot written or loaded, to skip
+	// writes when nothing changed
+	uint32_t crc;
+	size_t len;
+
+	// Where the device table is serialized, kept from one save to the next
+	uint8_t *data;
+	size_t cap;
+};
+
+int snapshot_init(struct snapshot *snapshot);
+void snapshot_finish(struct snapshot *snapshot);
+int snapshot_load(struct snapshot *snapshot, struct upower *state);
+int snapshot_save(struct snapshot *snapshot, struct upower *state);
+
+// Whether the snapshot of a device changes along with its last props
+bool snapshot_props_differ(const struct upower_device_props *a, const struct upower_device_props *b);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alert.h"
+#include "notify.h"
+#include "upower.h"
+
+// Runs the alert engine over every combination of last and current state,
+// warning level and online status, and checks it decides what the
+// send_*_update functions it replaced used to.
+
+static int failures;
+
+static void expect(const struct upower_device_props *last, const struct upower_device_props *current,
+		bool has_battery, const struct alert_action *expected, int expected_count) {
+	struct alert_action actions[ALERT_MAX_ACTIONS];
+	int count = alert_evaluate(last, current, has_battery, actions);
+
+	int mismatch = count == expected_count ? -1 : 0;
+	for (int idx = 0; mismatch == -1 && idx < count; idx++) {
+		if (actions[idx].kind != expected[idx].kind ||
+				actions[idx].urgency != expected[idx].urgency ||
+				strcmp(actions[idx].category, expected[idx].category) != 0) {
+			mismatch = idx;
+		}
+	}
+	if (mismatch == -1) {
+		return;
+	}
+
+	fprintf(stderr, "battery %d, state %d -> %d, level %d -> %d, online %d -> %d: ",
+		has_battery, last->state, current->state, last->warning_level, current->warning_level,
+		last->online, current->online);
+	if (count != expected_count) {
+		fprintf(stderr, "got %d actions, expected %d\n", count, expected_count);
+	} else {
+		fprintf(stderr, "got %s with urgency %d, expected %s with urgency %d\n",
+			actions[mismatch].category, actions[mismatch].urgency,
+			expected[mismatch].category, expected[mismatch].urgency);
+	}
+	failures++;
+}
+
+static const char *warning_category(enum upower_device_level level) {
+	switch (level) {
+	case UPOWER_DEVICE_LEVEL_NONE:
+		return "power.cleared";
+	case UPOWER_DEVICE_LEVEL_DISCHARGING:
+		return "power.discharging";
+	case UPOWER_DEVICE_LEVEL_LOW:
+		return "power.low";
+	case UPOWER_DEVICE_LEVEL_CRITICAL:
+		return "power.critical";
+	case UPOWER_DEVICE_LEVEL_ACTION:
+		return "power.action";
+	default:
+		return "power.unknown";
+	}
+}
+
+static void check_battery(const struct upower_device_props *last, const struct upower_device_props *current) {
+	struct alert_action expected[ALERT_MAX_ACTIONS];
+	int count = 0;
+
+	// Transitions to unknown are silenced
+	if (current->state != last->state && current->state != UPOWER_DEVICE_STATE_UNKNOWN) {
+		expected[count++] = (struct alert_action){
+			.kind = ALERT_STATE,
+			.urgency = current->state == UPOWER_DEVICE_STATE_EMPTY ? URGENCY_CRITICAL : URGENCY_NORMAL,
+			.category = "power.update",
+		};
+	}
+
+	// So is the first level known
+	if (current->warning_level != last->warning_level &&
+			!(current->warning_level == UPOWER_DEVICE_LEVEL_NONE &&
+			  last->warning_level == UPOWER_DEVICE_LEVEL_UNKNOWN)) {
+		expected[count++] = (struct alert_action){
+			.kind = ALERT_WARNING,
+			.urgency = current->warning_level == UPOWER_DEVICE_LEVEL_NONE ? URGENCY_NORMAL : URGENCY_CRITICAL,
+			.category = warning_category(current->warning_level),
+		};
+	}
+
+	expect(last, current, true, expected, count);
+
+	// An unknown state is never taken as a change from the last known one
+	struct upower_device_props next = alert_next_last(last, current);
+	enum upower_device_state state = current->state == UPOWER_DEVICE_STATE_UNKNOWN ?
+		last->state : current->state;
+	if (next.state != state || next.warning_level != current->warning_level) {
+		fprintf(stderr, "state %d -> %d: next last state %d, expected %d\n",
+			last->state, current->state, next.state, state);
+		failures++;
+	}
+}
+
+static void check_line_power(const struct upower_device_props *last, const struct upower_device_props *current) {
+	struct alert_action expected = {
+		.kind = ALERT_ONLINE,
+		.urgency = URGENCY_NORMAL,
+		.category = current->online ? "power.online" : "power.offline",
+	};
+	expect(last, current, false, &expected, current->online != last->online);
+}
+
+int main(void) {
+	// One past the last value stands in for values UPower may add later
+	for (int last_state = 0; last_state <= UPOWER_DEVICE_STATE_LAST; last_state++) {
+	for (int state = 0; state <= UPOWER_DEVICE_STATE_LAST; state++) {
+	for (int last_level = 0; last_level <= UPOWER_DEVICE_LEVEL_LAST; last_level++) {
+	for (int level = 0; level <= UPOWER_DEVICE_LEVEL_LAST; level++) {
+	for (int last_online = 0; last_online <= 1; last_online++) {
+	for (int online = 0; online <= 1; online++) {
+		struct upower_device_props last = {
+			.online = last_online,
+			.state = last_state,
+			.warning_level = last_level,
+		};
+		struct upower_device_props current = {
+			.online = online,
+			.state = state,
+			.warning_level = level,
+		};
+		check_battery(&last, &current);
+		check_line_power(&last, &current);
+	}
+	}
+	}
+	}
+	}
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "%d failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
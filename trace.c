@@ -0,0 +1,43 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.h"
+
+bool trace_enabled = false;
+
+static const char *stage_names[] = {
+	[TRACE_RECEIVE] = "receive",
+	[TRACE_DECODE] = "decode",
+	[TRACE_DECIDE] = "decide",
+	[TRACE_SEND] = "send",
+	[TRACE_REPLY] = "reply",
+};
+
+static uint64_t now_us(void) {
+	struct timespec current;
+	if (clock_gettime(CLOCK_MONOTONIC, &current) == -1) {
+		return 0;
+	}
+
+	return (uint64_t)current.tv_sec * 1000000 + current.tv_nsec / 1000;
+}
+
+void trace_stage(enum trace_stage stage, const char *subject, const char *detail) {
+	// Notifications may be sent from a thread of their own
+	static _Atomic uint64_t received_us, previous_us;
+	uint64_t now = now_us();
+
+	if (stage == TRACE_RECEIVE || received_us == 0) {
+		received_us = previous_us = now;
+	}
+
+	fprintf(stderr, "trace %lu.%06lu %-7s +%8.3f ms, %8.3f ms since receive: %s%s%s\n",
+		(unsigned long)(now / 1000000), (unsigned long)(now % 1000000), stage_names[stage],
+		(now - previous_us) / 1000.0, (now - received_us) / 1000.0,
+		subject != NULL ? subject : "", detail != NULL ? " " : "", detail != NULL ? detail : "");
+	previous_us = now;
+}
@@ -0,0 +1,42 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+
+// Stages an event passes through on its way to a notification. Each has a
+// static tracepoint in the poweralertd provider, taking the subject (device
+// path or notification category) and a detail string as arguments, e.g.
+//
+//   bpftrace -e 'usdt:./poweralertd:poweralertd:decide { printf("%s\n", str(arg1)); }'
+//
+// The tracepoints are nops unless attached to, and trace_stage() only
+// prints when -T is given.
+enum trace_stage {
+	TRACE_RECEIVE,
+	TRACE_DECODE,
+	TRACE_DECIDE,
+	TRACE_SEND,
+	TRACE_REPLY,
+};
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, subject, detail) DTRACE_PROBE2(poweralertd, name, subject, detail)
+#else
+#define TRACE_PROBE(name, subject, detail) do { } while (0)
+#endif
+
+#define TRACE(name, stage, subject, detail) do { \
+	TRACE_PROBE(name, subject, detail); \
+	if (trace_enabled) { \
+		trace_stage(stage, subject, detail); \
+	} \
+} while (0)
+
+extern bool trace_enabled;
+
+// Prints the stage with its CLOCK_MONOTONIC timestamp, and the time since
+// the previous stage and since the signal that started the event.
+void trace_stage(enum trace_stage stage, const char *subject, const char *detail);
+
+#endif
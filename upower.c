@@ -1,4 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +8,8 @@
 #include <string.h>
 
 #include "dbus.h"
+#include "record.h"
+#include "trace.h"
 #include "upower.h"
 
 static char *upower_state_string[UPOWER_DEVICE_STATE_LAST] = {
@@ -74,12 +78,81 @@ static int upower_compare_path(const void *item, const void *data) {
 	return -1;
 }
 
-static struct upower_device *upower_device_create() {
-	struct upower_device *device = calloc(1, sizeof(struct upower_device));
+#ifdef POWERALERTD_DEVICE_POOL
+// Devices and their strings live in a pool set aside once, so that keeping
+// track of devices never touches the heap. Running out of room in the pool
+// fails like running out of memory would.
+struct upower_device_slot {
+	struct upower_device device;
+	bool used;
+	char path[UPOWER_DEVICE_STR_MAX];
+	char native_path[UPOWER_DEVICE_STR_MAX];
+	char model[UPOWER_DEVICE_STR_MAX];
+};
+
+static struct upower_device_slot device_pool[POWERALERTD_DEVICE_POOL];
+
+static struct upower_device *upower_device_alloc(void) {
+	for (int idx = 0; idx < POWERALERTD_DEVICE_POOL; idx++) {
+		struct upower_device_slot *slot = &device_pool[idx];
+		if (slot->used) {
+			continue;
+		}
+		*slot = (struct upower_device_slot){ .used = true };
+		slot->device.path = slot->path;
+		slot->device.native_path = slot->native_path;
+		slot->device.model = slot->model;
+		return &slot->device;
+	}
+	fprintf(stderr, "device pool of %d devices exhausted\n", POWERALERTD_DEVICE_POOL);
+	return NULL;
+}
+
+static void upower_device_free(struct upower_device *device) {
+	((struct upower_device_slot *)device)->used = false;
+}
+
+int upower_device_set_string(char **field, const char *value) {
+	size_t len = strlen(value);
+	if (len >= UPOWER_DEVICE_STR_MAX) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(*field, value, len + 1);
+	return 0;
+}
+#else
+static struct upower_device *upower_device_alloc(void) {
+	return calloc(1, sizeof(struct upower_device));
+}
+
+static void upower_device_free(struct upower_device *device) {
+	free(device->path);
+	free(device->native_path);
+	free(device->model);
+	free(device);
+}
+
+int upower_device_set_string(char **field, const char *value) {
+	char *copy = strdup(value);
+	if (copy == NULL) {
+		return -ENOMEM;
+	}
+	free(*field);
+	*field = copy;
+	return 0;
+}
+#endif
+
+static struct upower_device *upower_device_create(void) {
+	struct upower_device *device = upower_device_alloc();
+	if (device == NULL) {
+		return NULL;
+	}
 	device->last.warning_level = UPOWER_DEVICE_LEVEL_NONE;
 	device->current.warning_level = UPOWER_DEVICE_LEVEL_NONE;
 	device->last.battery_level = UPOWER_DEVICE_LEVEL_NONE;
 	device->current.battery_level = UPOWER_DEVICE_LEVEL_NONE;
+	device->progress = -1;
 	return device;
 }
 
@@ -88,23 +161,72 @@ void upower_device_destroy(struct upower_device *device) {
 		return;
 	}
 
-	if (device->path != NULL) {
-		free(device->path);
-		device->path = NULL;
-	}
-	if (device->native_path != NULL) {
-		free(device->native_path);
-		device->native_path = NULL;
-	}
-	if (device->model != NULL) {
-		free(device->model);
-		device->model = NULL;
-	}
 	if (device->slot != NULL) {
 		sd_bus_slot_unref(device->slot);
 		device->slot = NULL;
 	}
-	free(device);
+	upower_device_free(device);
+}
+
+int upower_create_lists(struct upower *state) {
+	// With a pool, the lists never need to grow past it either
+#ifdef POWERALERTD_DEVICE_POOL
+	int capacity = POWERALERTD_DEVICE_POOL;
+#else
+	int capacity = 10;
+#endif
+	state->devices = create_list_with_capacity(capacity);
+	state->removed_devices = create_list_with_capacity(capacity);
+	if (state->devices == NULL || state->removed_devices == NULL) {
+		list_free(state->devices);
+		list_free(state->removed_devices);
+		state->devices = state->removed_devices = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+const struct upower_extended_prop upower_extended_props[5] = {
+	{ UPOWER_DEVICE_PROP_ENERGY_RATE, "EnergyRate", "d", offsetof(struct upower_device_props, energy_rate) },
+	{ UPOWER_DEVICE_PROP_TIME_TO_EMPTY, "TimeToEmpty", "x", offsetof(struct upower_device_props, time_to_empty) },
+	{ UPOWER_DEVICE_PROP_TIME_TO_FULL, "TimeToFull", "x", offsetof(struct upower_device_props, time_to_full) },
+	{ UPOWER_DEVICE_PROP_TEMPERATURE, "Temperature", "d", offsetof(struct upower_device_props, temperature) },
+	{ UPOWER_DEVICE_PROP_CAPACITY, "Capacity", "d", offsetof(struct upower_device_props, capacity) },
+};
+
+static const struct upower_extended_prop *upower_extended_prop(const char *name) {
+	for (size_t idx = 0; idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+		if (strcmp(upower_extended_props[idx].name, name) == 0) {
+			return &upower_extended_props[idx];
+		}
+	}
+	return NULL;
+}
+
+void upower_device_apply(struct upower_device *device, uint32_t mask, const struct upower_device_props *props) {
+	if (mask & UPOWER_DEVICE_PROP_ONLINE) {
+		device->current.online = props->online;
+	}
+	if (mask & UPOWER_DEVICE_PROP_PERCENTAGE) {
+		device->current.percentage = props->percentage;
+	}
+	if (mask & UPOWER_DEVICE_PROP_STATE) {
+		device->current.state = props->state;
+	}
+	if (mask & UPOWER_DEVICE_PROP_WARNING_LEVEL) {
+		device->current.warning_level = props->warning_level;
+	}
+	if (mask & UPOWER_DEVICE_PROP_BATTERY_LEVEL) {
+		device->current.battery_level = props->battery_level;
+	}
+	if (mask & UPOWER_DEVICE_PROPS_EXTENDED) {
+		for (size_t idx = 0; idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+			const struct upower_extended_prop *prop = &upower_extended_props[idx];
+			if (mask & prop->bit) {
+				memcpy((char *)&device->current + prop->offset, (const char *)props + prop->offset, 8);
+			}
+		}
+	}
 }
 
 char* upower_device_state_string(struct upower_device *device) {
@@ -144,7 +266,37 @@ int upower_device_type_int(char *device) {
 	return -1;
 }
 
-static int upower_device_update_state(sd_bus *bus, struct upower_device *device) {
+// Reads the extended properties in props, for devices that just started
+// needing them
+static int upower_device_update_extended(struct upower *state, struct upower_device *device, uint32_t props) {
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int ret = 0;
+
+	for (size_t idx = 0; idx < sizeof(upower_extended_props) / sizeof(upower_extended_props[0]); idx++) {
+		const struct upower_extended_prop *prop = &upower_extended_props[idx];
+		if (!(props & prop->bit)) {
+			continue;
+		}
+		ret = sd_bus_get_property_trivial(
+		    state->bus,
+		    "org.freedesktop.UPower",
+		    device->path,
+		    "org.freedesktop.UPower.Device",
+		    prop->name,
+		    &error,
+		    prop->signature[0],
+		    (char *)&device->current + prop->offset);
+		if (ret < 0) {
+			break;
+		}
+	}
+
+	sd_bus_error_free(&error);
+	return ret;
+}
+
+static int upower_device_update_state(struct upower *state, struct upower_device *device) {
+	sd_bus *bus = state->bus;
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	int ret;
 
@@ -160,10 +312,11 @@ static int upower_device_update_state(sd_bus *bus, struct upower_device *device)
 	if (ret < 0) {
 		goto finish;
 	}
-	if (device->native_path != NULL) {
-		free(device->native_path);
+	ret = upower_device_set_string(&device->native_path, native_path);
+	free(native_path);
+	if (ret < 0) {
+		goto finish;
 	}
-	device->native_path = strdup(native_path);
 
 	ret = sd_bus_get_property_trivial(
 	    bus,
@@ -203,10 +356,18 @@ static int upower_device_update_state(sd_bus *bus, struct upower_device *device)
 	if (ret < 0) {
 		goto finish;
 	}
-	if (device->model != NULL) {
-		free(device->model);
+	ret = upower_device_set_string(&device->model, model);
+	free(model);
+	if (ret < 0) {
+		goto finish;
+	}
+
+	// The static properties are all the policy needs, so subscribe before
+	// reading the rest to not miss any change in between
+	ret = upower_device_subscribe(state, device);
+	if (ret < 0) {
+		goto finish;
 	}
-	device->model = strdup(model);
 
 	ret = sd_bus_get_property_trivial(
 	    bus,
@@ -269,14 +430,22 @@ static int upower_device_update_state(sd_bus *bus, struct upower_device *device)
 	    &error,
 	    'd',
 	    &device->current.percentage);
+	if (ret < 0) {
+		goto finish;
+	}
+
+	if (device->policy.props != 0) {
+		ret = upower_device_update_extended(state, device, device->policy.props);
+	}
 
 finish:
 	sd_bus_error_free(&error);
 	return ret;
 }
 
-static int handle_upower_device_properties_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
-	struct upower_device *state = userdata;
+int upower_decode_properties_changed(sd_bus_message *msg, uint32_t wanted, uint32_t *mask,
+		struct upower_device_props *props) {
+	const struct upower_extended_prop *prop;
 	int ret;
 
 	ret = sd_bus_message_skip(msg, "s");
@@ -303,27 +472,38 @@ static int handle_upower_device_properties_changed(sd_bus_message *msg, void *us
 			goto error;
 		}
 		if (strcmp(name, "State") == 0) {
-			ret = sd_bus_message_read(msg, "v", "u", &state->current.state);
+			ret = sd_bus_message_read(msg, "v", "u", &props->state);
+			*mask |= UPOWER_DEVICE_PROP_STATE;
 			if (ret < 0) {
 				goto error;
 			}
 		} else if (strcmp(name, "WarningLevel") == 0) {
-			ret = sd_bus_message_read(msg, "v", "u", &state->current.warning_level);
+			ret = sd_bus_message_read(msg, "v", "u", &props->warning_level);
+			*mask |= UPOWER_DEVICE_PROP_WARNING_LEVEL;
 			if (ret < 0) {
 				goto error;
 			}
 		} else if (strcmp(name, "BatteryLevel") == 0) {
-			ret = sd_bus_message_read(msg, "v", "u", &state->current.battery_level);
+			ret = sd_bus_message_read(msg, "v", "u", &props->battery_level);
+			*mask |= UPOWER_DEVICE_PROP_BATTERY_LEVEL;
 			if (ret < 0) {
 				goto error;
 			}
 		} else if (strcmp(name, "Online") == 0) {
-			ret = sd_bus_message_read(msg, "v", "b", &state->current.online);
+			ret = sd_bus_message_read(msg, "v", "b", &props->online);
+			*mask |= UPOWER_DEVICE_PROP_ONLINE;
 			if (ret < 0) {
 				goto error;
 			}
 		} else if (strcmp(name, "Percentage") == 0) {
-			ret = sd_bus_message_read(msg, "v", "d", &state->current.percentage);
+			ret = sd_bus_message_read(msg, "v", "d", &props->percentage);
+			*mask |= UPOWER_DEVICE_PROP_PERCENTAGE;
+			if (ret < 0) {
+				goto error;
+			}
+		} else if (wanted != 0 && (prop = upower_extended_prop(name)) != NULL && (wanted & prop->bit)) {
+			ret = sd_bus_message_read(msg, "v", prop->signature, (char *)props + prop->offset);
+			*mask |= prop->bit;
 			if (ret < 0) {
 				goto error;
 			}
@@ -367,10 +547,29 @@ static int handle_upower_device_properties_changed(sd_bus_message *msg, void *us
 	return 0;
 
 error:
-	fprintf(stderr, "handle_upower_device_properties_changed failed: %s\n", strerror(-ret));
 	return ret;
 }
 
+static int handle_upower_device_properties_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct upower_device *device = userdata;
+	struct upower_device_props props = { 0 };
+	uint32_t mask = 0;
+
+	TRACE(receive, TRACE_RECEIVE, device->path, sd_bus_message_get_member(msg));
+	int ret = upower_decode_properties_changed(msg, device->policy.props, &mask, &props);
+	if (ret < 0) {
+		fprintf(stderr, "handle_upower_device_properties_changed failed: %s\n", strerror(-ret));
+		return ret;
+	}
+	TRACE(decode, TRACE_DECODE, device->path, NULL);
+
+	upower_device_apply(device, mask, &props);
+	if (device->upower->recorder != NULL) {
+		record_device_changed(device->upower->recorder, device->path, mask, &props);
+	}
+	return 0;
+}
+
 static int upower_device_register_notification(sd_bus *bus, struct upower_device *device) {
 	char match[512];
 	snprintf(match, 512, "type='signal',path='%s',interface='org.freedesktop.DBus.Properties',member='PropertiesChanged'", device->path);
@@ -378,50 +577,122 @@ static int upower_device_register_notification(sd_bus *bus, struct upower_device
 	return sd_bus_add_match(bus, &device->slot, match, handle_upower_device_properties_changed, device);
 }
 
-static int handle_upower_device_added(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
-	struct upower *state = userdata;
-	struct upower_device *device;
-	int ret, idx;
+// Laptop batteries are covered by the DisplayDevice composite, which is a
+// battery supplying power itself.
+static bool upower_device_is_system_battery(struct upower *state, struct upower_device *device) {
+	const char *display_path = state->display_path != NULL ?
+		state->display_path : UPOWER_DISPLAY_DEVICE_PATH;
+	return device->type == UPOWER_DEVICE_TYPE_BATTERY && device->power_supply &&
+		strcmp(device->path, display_path) != 0;
+}
 
-	char *path;
-	ret = sd_bus_message_read(msg, "o", &path);
-	if (ret < 0) {
-		goto error;
+// Decides the policy of a device once its static properties are known.
+// Ignored devices are not subscribed to at all, so their property changes
+// never even reach us.
+int upower_device_subscribe(struct upower *state, struct upower_device *device) {
+	device->policy = (struct upower_device_policy){ 0 };
+	if (state->policy != NULL) {
+		state->policy(device, &device->policy, state->policy_data);
+	}
+	if (state->display_device && upower_device_is_system_battery(state, device)) {
+		device->policy.ignored = true;
 	}
 
+	if (device->policy.ignored) {
+		if (device->slot != NULL) {
+			sd_bus_slot_unref(device->slot);
+			device->slot = NULL;
+		}
+		return 0;
+	}
+
+	// Replayed devices have no bus to subscribe to
+	if (state->bus == NULL || device->slot != NULL) {
+		return 0;
+	}
+	return upower_device_register_notification(state->bus, device);
+}
+
+int upower_decode_device_path(sd_bus_message *msg, const char **path) {
+	return sd_bus_message_read(msg, "o", path);
+}
+
+struct upower_device *upower_add_device(struct upower *state, const char *path) {
+	struct upower_device *device;
+	int idx;
+
 	// Look for doubly-added devices
 	idx = list_seq_find(state->devices, upower_compare_path, path);
 	if (idx != -1) {
-		device = state->devices->items[idx];
-		goto update;
+		return state->devices->items[idx];
 	}
 
 	// Look for recently removed devices
 	idx = list_seq_find(state->removed_devices, upower_compare_path, path);
 	if (idx != -1) {
 		device = state->removed_devices->items[idx];
-		list_add(state->devices, device);
+		if (list_add(state->devices, device) < 0) {
+			return NULL;
+		}
 		list_del(state->removed_devices, idx);
-		goto update;
+		state->dirty = true;
+		return device;
 	}
 
 	// Fresh device
-	device = calloc(1, sizeof(struct upower_device));
-	device->path = strdup(path);
+	device = upower_device_create();
+	if (device == NULL) {
+		return NULL;
+	}
+	device->upower = state;
+	if (upower_device_set_string(&device->path, path) < 0 ||
+			list_add(state->devices, device) < 0) {
+		upower_device_destroy(device);
+		return NULL;
+	}
+	state->dirty = true;
 
-	list_add(state->devices, device);
+	return device;
+}
 
-	ret = upower_device_register_notification(state->bus, device);
+int upower_remove_device(struct upower *state, const char *path) {
+	int idx = list_seq_find(state->devices, upower_compare_path, path);
+	if (idx != -1) {
+		list_add(state->removed_devices, state->devices->items[idx]);
+		list_del(state->devices, idx);
+		state->dirty = true;
+	}
+	return 0;
+}
+
+static int handle_upower_device_added(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct upower *state = userdata;
+	struct upower_device *device;
+	int ret;
+
+	const char *path;
+	TRACE(receive, TRACE_RECEIVE, sd_bus_message_get_path(msg), sd_bus_message_get_member(msg));
+	ret = upower_decode_device_path(msg, &path);
 	if (ret < 0) {
 		goto error;
 	}
+	TRACE(decode, TRACE_DECODE, path, NULL);
+
+	device = upower_add_device(state, path);
+	if (device == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
 
-update:
-	ret = upower_device_update_state(state->bus, device);
+	ret = upower_device_update_state(state, device);
 	if (ret < 0) {
 		goto error;
 	}
 
+	if (state->recorder != NULL) {
+		record_device_added(state->recorder, device);
+	}
+
 	return 0;
 
 error:
@@ -433,16 +704,18 @@ static int handle_upower_device_removed(sd_bus_message *msg, void *userdata, sd_
 	struct upower *state = userdata;
 	int ret;
 
-	char *path;
-	ret = sd_bus_message_read(msg, "o", &path);
+	const char *path;
+	TRACE(receive, TRACE_RECEIVE, sd_bus_message_get_path(msg), sd_bus_message_get_member(msg));
+	ret = upower_decode_device_path(msg, &path);
 	if (ret < 0) {
 		goto error;
 	}
+	TRACE(decode, TRACE_DECODE, path, NULL);
 
-	int idx = list_seq_find(state->devices, upower_compare_path, path);
-	if (idx != -1) {
-		list_add(state->removed_devices, state->devices->items[idx]);
-		list_del(state->devices, idx);
+	upower_remove_device(state, path);
+
+	if (state->recorder != NULL) {
+		record_device_removed(state->recorder, path);
 	}
 
 	return 0;
@@ -452,34 +725,78 @@ error:
 	return ret;
 }
 
-int init_upower(sd_bus *bus, struct upower *state) {
+// The DisplayDevice is not enumerated, and has to be asked for
+static int upower_sync_display_device(struct upower *state, list_t *seen) {
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	sd_bus_message *msg = NULL;
+	const char *path;
 	int ret;
 
-	ret = sd_bus_add_match(
-		bus,
-		NULL,
-		"type='signal',path='/org/freedesktop/UPower',interface='org.freedesktop.UPower',member='DeviceAdded'",
-		handle_upower_device_added,
-		state);
-
+	ret = sd_bus_call_method(state->bus,
+	    "org.freedesktop.UPower",
+	    "/org/freedesktop/UPower",
+	    "org.freedesktop.UPower",
+	    "GetDisplayDevice",
+	    &error,
+	    &msg,
+	    "");
+	if (ret < 0) {
+		goto error;
+	}
+	ret = sd_bus_message_read(msg, "o", &path);
 	if (ret < 0) {
 		goto error;
 	}
 
-	ret = sd_bus_add_match(
-		bus,
-		NULL,
-		"type='signal',path='/org/freedesktop/UPower',interface='org.freedesktop.UPower',member='DeviceRemoved'",
-		handle_upower_device_removed,
-		state);
+	if (state->display_path == NULL || strcmp(state->display_path, path) != 0) {
+		free(state->display_path);
+		state->display_path = strdup(path);
+		if (state->display_path == NULL) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
 
+	struct upower_device *device = upower_add_device(state, path);
+	if (device == NULL) {
+		ret = -ENOMEM;
+		goto error;
+	}
+	ret = upower_device_update_state(state, device);
 	if (ret < 0) {
 		goto error;
 	}
+	list_add(seen, device);
+
+	if (state->recorder != NULL) {
+		record_device_added(state->recorder, device);
+	}
 
-	ret = sd_bus_call_method(bus,
+error:
+	sd_bus_error_free(&error);
+	sd_bus_message_unref(msg);
+
+	return ret;
+}
+
+// Enumerates the devices known to UPower and reconciles them with the
+// device table. Known devices keep their last props and notification IDs
+// and only have their properties refreshed, so a UPower restart leads to
+// notifications only for what actually changed meanwhile.
+int upower_sync(struct upower *state) {
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	sd_bus_message *msg = NULL;
+	list_t *seen = create_list();
+	int ret;
+
+	if (state->display_device) {
+		ret = upower_sync_display_device(state, seen);
+		if (ret < 0) {
+			goto error;
+		}
+	}
+
+	ret = sd_bus_call_method(state->bus,
 	    "org.freedesktop.UPower",
 	    "/org/freedesktop/UPower",
 	    "org.freedesktop.UPower",
@@ -487,15 +804,15 @@ int init_upower(sd_bus *bus, struct upower *state) {
 	    &error,
 	    &msg,
 	    "");
+	if (ret < 0) {
+		goto error;
+	}
 
 	ret = sd_bus_message_enter_container(msg, 'a', "o");
 	if (ret < 0) {
 		goto error;
 	}
 
-	state->devices = create_list();
-	state->removed_devices = create_list();
-
 	while (1) {
 		char *path;
 		ret = sd_bus_message_read(msg, "o", &path);
@@ -505,18 +822,20 @@ int init_upower(sd_bus *bus, struct upower *state) {
 			break;
 		}
 
-		struct upower_device *device = upower_device_create();
-		list_add(state->devices, device);
-
-		device->path = strdup(path);
-		ret = upower_device_register_notification(bus, device);
-		if (ret < 0) {
+		struct upower_device *device = upower_add_device(state, path);
+		if (device == NULL) {
+			ret = -ENOMEM;
 			goto error;
 		}
-		ret = upower_device_update_state(bus, device);
+		ret = upower_device_update_state(state, device);
 		if (ret < 0) {
 			goto error;
 		}
+		list_add(seen, device);
+
+		if (state->recorder != NULL) {
+			record_device_added(state->recorder, device);
+		}
 	}
 
 	ret = sd_bus_message_exit_container(msg);
@@ -524,13 +843,135 @@ int init_upower(sd_bus *bus, struct upower *state) {
 		goto error;
 	}
 
+	for (int idx = state->devices->length - 1; idx >= 0; idx--) {
+		struct upower_device *device = state->devices->items[idx];
+		if (list_find(seen, device) != -1) {
+			continue;
+		}
+		if (state->recorder != NULL) {
+			record_device_removed(state->recorder, device->path);
+		}
+		upower_remove_device(state, device->path);
+	}
+
 error:
+	list_free(seen);
 	sd_bus_error_free(&error);
 	sd_bus_message_unref(msg);
 
 	return ret;
 }
 
+// Re-decides the policy of every known device after the configuration
+// changed. Devices that stop being ignored have missed every change since
+// they were added, so only those have their properties fetched again, and
+// their current state is taken as already notified about.
+int upower_refresh_policies(struct upower *state) {
+	for (int idx = 0; idx < state->devices->length; idx++) {
+		struct upower_device *device = state->devices->items[idx];
+		bool was_ignored = device->policy.ignored;
+		uint32_t had_props = device->policy.props;
+
+		int ret = upower_device_subscribe(state, device);
+		if (ret < 0) {
+			return ret;
+		}
+		if (device->policy.ignored || state->bus == NULL) {
+			continue;
+		}
+		if (!was_ignored) {
+			// Newly needed extended properties are unknown so far
+			uint32_t added = device->policy.props & ~had_props;
+			ret = added != 0 ? upower_device_update_extended(state, device, added) : 0;
+			if (ret < 0) {
+				return ret;
+			}
+			continue;
+		}
+
+		ret = upower_device_update_state(state, device);
+		if (ret < 0) {
+			return ret;
+		}
+		device->last = device->current;
+	}
+	return 0;
+}
+
+static int handle_upower_owner_changed(sd_bus_message *msg, void *userdata, sd_bus_error *ret_error) {
+	struct upower *state = userdata;
+	const char *name, *old_owner, *new_owner;
+	int ret;
+
+	ret = sd_bus_message_read(msg, "sss", &name, &old_owner, &new_owner);
+	if (ret < 0) {
+		goto error;
+	}
+
+	if (new_owner[0] == '\0') {
+		fprintf(stderr, "UPower went away, waiting for it to return\n");
+		return 0;
+	}
+
+	ret = upower_sync(state);
+	if (ret < 0) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	fprintf(stderr, "handle_upower_owner_changed failed: %s\n", strerror(-ret));
+	return ret;
+}
+
+int init_upower(sd_bus *bus, struct upower *state) {
+	int ret;
+
+	// Devices may already have been restored from a snapshot
+	if (state->devices == NULL) {
+		ret = upower_create_lists(state);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	ret = sd_bus_add_match(
+		bus,
+		NULL,
+		"type='signal',path='/org/freedesktop/UPower',interface='org.freedesktop.UPower',member='DeviceAdded'",
+		handle_upower_device_added,
+		state);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_add_match(
+		bus,
+		NULL,
+		"type='signal',path='/org/freedesktop/UPower',interface='org.freedesktop.UPower',member='DeviceRemoved'",
+		handle_upower_device_removed,
+		state);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = sd_bus_add_match(
+		bus,
+		NULL,
+		"type='signal',sender='org.freedesktop.DBus',path='/org/freedesktop/DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.freedesktop.UPower'",
+		handle_upower_owner_changed,
+		state);
+
+	if (ret < 0) {
+		return ret;
+	}
+
+	return upower_sync(state);
+}
+
 void destroy_upower(sd_bus *bus, struct upower *state) {
 	if (state->devices != NULL) {
 		for (int idx = 0; idx < state->devices->length; idx++) {
@@ -539,4 +980,13 @@ void destroy_upower(sd_bus *bus, struct upower *state) {
 		list_free(state->devices);
 		state->devices = NULL;
 	}
+	if (state->removed_devices != NULL) {
+		for (int idx = 0; idx < state->removed_devices->length; idx++) {
+			upower_device_destroy(state->removed_devices->items[idx]);
+		}
+		list_free(state->removed_devices);
+		state->removed_devices = NULL;
+	}
+	free(state->display_path);
+	state->display_path = NULL;
 }
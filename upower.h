@@ -1,6 +1,10 @@
 #ifndef _UPOWER_H
 #define _UPOWER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "dbus.h"
 #include "list.h"
 
@@ -68,12 +72,39 @@ enum upower_device_type {
 	UPOWER_DEVICE_TYPE_LAST
 };
 
+// Longest string a device can hold when built with a device pool
+#define UPOWER_DEVICE_STR_MAX 256
+
+#define UPOWER_DISPLAY_DEVICE_PATH "/org/freedesktop/UPower/devices/DisplayDevice"
+
 enum change_slot {
 	SLOT_STATE = 0,
 	SLOT_WARNING = 1,
 	SLOT_ONLINE = 2,
 };
 
+// Bits identifying the monitored properties in a PropertiesChanged signal
+enum upower_device_prop {
+	UPOWER_DEVICE_PROP_ONLINE = 1 << 0,
+	UPOWER_DEVICE_PROP_PERCENTAGE = 1 << 1,
+	UPOWER_DEVICE_PROP_STATE = 1 << 2,
+	UPOWER_DEVICE_PROP_WARNING_LEVEL = 1 << 3,
+	UPOWER_DEVICE_PROP_BATTERY_LEVEL = 1 << 4,
+
+	// Extended properties, only decoded for devices whose policy asks
+	// for them
+	UPOWER_DEVICE_PROP_ENERGY_RATE = 1 << 5,
+	UPOWER_DEVICE_PROP_TIME_TO_EMPTY = 1 << 6,
+	UPOWER_DEVICE_PROP_TIME_TO_FULL = 1 << 7,
+	UPOWER_DEVICE_PROP_TEMPERATURE = 1 << 8,
+	UPOWER_DEVICE_PROP_CAPACITY = 1 << 9,
+};
+
+#define UPOWER_DEVICE_PROPS_BASIC (UPOWER_DEVICE_PROP_ONLINE | UPOWER_DEVICE_PROP_PERCENTAGE | \
+	UPOWER_DEVICE_PROP_STATE | UPOWER_DEVICE_PROP_WARNING_LEVEL | UPOWER_DEVICE_PROP_BATTERY_LEVEL)
+#define UPOWER_DEVICE_PROPS_EXTENDED (UPOWER_DEVICE_PROP_ENERGY_RATE | UPOWER_DEVICE_PROP_TIME_TO_EMPTY | \
+	UPOWER_DEVICE_PROP_TIME_TO_FULL | UPOWER_DEVICE_PROP_TEMPERATURE | UPOWER_DEVICE_PROP_CAPACITY)
+
 struct upower_device_props {
 	int generation;
 	int online;
@@ -81,6 +112,46 @@ struct upower_device_props {
 	enum upower_device_state state;
 	enum upower_device_level warning_level;
 	enum upower_device_level battery_level;
+
+	// Extended properties, in W, seconds, °C and percent of the design
+	// capacity. Only valid if in the props of the device policy.
+	double energy_rate;
+	int64_t time_to_empty;
+	int64_t time_to_full;
+	double temperature;
+	double capacity;
+};
+
+// How an extended property is decoded. Every one of them is 8 bytes wide.
+struct upower_extended_prop {
+	enum upower_device_prop bit;
+	const char *name;
+	const char *signature;
+	size_t offset;
+};
+
+extern const struct upower_extended_prop upower_extended_props[5];
+
+// Decided once the static properties of a device are known, and again
+// when the configuration changes
+struct upower_device_policy {
+	bool ignored;
+
+	// Percentages below which a discharging device is considered low or
+	// critical regardless of what UPower says, 0 if unset
+	int low;
+	int critical;
+
+	// Temperature in °C at which the battery is too hot, and percentage of
+	// its design capacity below which it is worn out, 0 if unset
+	int hot;
+	int worn;
+
+	// Whether state notifications show energy rate and time remaining
+	bool details;
+
+	// Extended properties needed for the above, the only ones decoded
+	uint32_t props;
 };
 
 struct upower_device {
@@ -98,14 +169,41 @@ struct upower_device {
 	// Property notification
 	uint32_t notifications[3];
 
+	// Last percentage step shown as progress, and when
+	int progress;
+	uint64_t progress_ms;
+
+	struct upower_device_policy policy;
+
 	// sd_bus notification slot
 	sd_bus_slot *slot;
+
+	struct upower *upower;
 };
 
+struct recorder;
+
 struct upower {
 	list_t *devices;
 	list_t *removed_devices;
 	sd_bus *bus;
+
+	// Receives every decoded signal if set
+	struct recorder *recorder;
+
+	// Track the DisplayDevice composite for system power instead of the
+	// laptop batteries it is made of
+	bool display_device;
+	char *display_path;
+
+	// Fills in the policy of a device, consulted once its static
+	// properties are known
+	void (*policy)(struct upower_device *device, struct upower_device_policy *policy, void *data);
+	void *policy_data;
+
+	// Set whenever devices come and go, or what was last notified about
+	// one of them changes, until the next snapshot is saved
+	bool dirty;
 };
 
 int upower_device_has_battery(struct upower_device *device);
@@ -115,8 +213,23 @@ char* upower_device_battery_level_string(struct upower_device *device);
 char* upower_device_type_string(struct upower_device *device);
 int upower_device_type_int(char *device);
 void upower_device_destroy(struct upower_device *device);
+int upower_device_set_string(char **field, const char *value);
+void upower_device_apply(struct upower_device *device, uint32_t mask, const struct upower_device_props *props);
+
+// Decoders for the signal payloads, exposed for fuzzing and benchmarks.
+// Extended properties are only decoded if in wanted, and skipped otherwise.
+int upower_decode_properties_changed(sd_bus_message *msg, uint32_t wanted, uint32_t *mask,
+		struct upower_device_props *props);
+int upower_decode_device_path(sd_bus_message *msg, const char **path);
+
+struct upower_device *upower_add_device(struct upower *state, const char *path);
+int upower_remove_device(struct upower *state, const char *path);
+int upower_device_subscribe(struct upower *state, struct upower_device *device);
+int upower_refresh_policies(struct upower *state);
 
+int upower_create_lists(struct upower *state);
 int init_upower(sd_bus *bus, struct upower *state);
+int upower_sync(struct upower *state);
 void destroy_upower(sd_bus *bus, struct upower *state);
 
 #endif